@@ -1,14 +1,35 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <utility>
 
 #include "msa.hpp"
 #include "msa_stats.hpp"
+#include "msa_stream.hpp"
 #include "run.hpp"
+#include "utils.hpp"
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
 
 int
 main(int argc, char* argv[])
 {
+  // With MPI, all processes read the alignment and sample, but only the root
+  // process (rank 0) trains the model and writes output.
+  bool is_root = true;
+#ifdef USE_MPI
+  int mpi_thread_support;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &mpi_thread_support);
+  int mpi_rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  is_root = (mpi_rank == 0);
+  if (!is_root) {
+    std::cout.setstate(std::ios_base::failbit);
+  }
+#endif
+
   std::string input_file;
   std::string config_file;
   std::string numeric_file;
@@ -20,11 +41,18 @@ main(int argc, char* argv[])
   bool numeric_msa_given = false;
   bool input_file_given = true;
   bool weight_given = false;
+  bool binary_msa_output = false;
+  bool collapse_duplicates = false;
+  double pos_gap_max = -1;
+  double seq_gap_max = -1;
   double threshold = 0.8;
+  long int stream_budget = 0;
+  bool quick = false;
+  bool resume = false;
 
   // Read command-line parameters.
   char c;
-  while ((c = getopt(argc, argv, "i:d:c:rpn:w:t:")) != -1) {
+  while ((c = getopt(argc, argv, "i:d:c:rpn:w:t:bs:ug:G:qR:")) != -1) {
     switch (c) {
       case 'i':
         input_file = optarg;
@@ -57,77 +85,179 @@ main(int argc, char* argv[])
       case 't':
         threshold = std::stod(optarg);
         break;
+      case 'b':
+        binary_msa_output = true;
+        break;
+      case 's':
+        stream_budget = (long int)(std::stod(optarg) * 1024 * 1024);
+        break;
+      case 'u':
+        collapse_duplicates = true;
+        break;
+      case 'g':
+        pos_gap_max = std::stod(optarg);
+        break;
+      case 'G':
+        seq_gap_max = std::stod(optarg);
+        break;
+      case 'q':
+        quick = true;
+        break;
+      case 'R':
+        dest_dir = optarg;
+        dest_dir_given = true;
+        resume = true;
+        break;
       case '?':
         std::cerr << "ERROR: Incorrect command line usage." << std::endl;
         std::exit(EXIT_FAILURE);
     }
   }
 
-  // If both the numeric matrix and sequence weights are given, don't bother
-  // converting the FASTA file.
-  if (numeric_msa_given && weight_given) {
-    // Parse the multiple sequence alignment. Reweight sequences if desired.
-    MSA msa = MSA(numeric_file, weight_file, numeric_msa_given);
-    msa.writeSequenceWeights(dest_dir + "/sequence_weights.txt");
-    msa.writeMatrix(dest_dir + "/msa_numerical.txt");
-
-    // Compute the statistics of the MSA.
-    MSAStats msa_stats = MSAStats(msa);
-    msa_stats.writeFrequency1p(dest_dir + "/stat_align_1p.txt");
-    msa_stats.writeFrequency2p(dest_dir + "/stat_align_2p.txt");
-    msa_stats.writeRelEntropyGradient(dest_dir + "/rel_ent_grad_align_1p.txt");
+  // A resumed run reads the settings that it wrote when it started, unless
+  // others are given.
+  if (resume && config_file.empty()) {
+    config_file = dest_dir + "/bmdca_params.conf";
+  }
 
-    // Initialize the MCMC using the statistics of the MSA.
-    Sim sim = Sim(msa_stats, config_file);
+  // Only the statistics of the alignment are needed for training, so the MSA
+  // is freed as soon as they are computed, unless its sequences initialize
+  // the parameters by pseudo-likelihood or the chains.
+  MSAStats* msa_stats = nullptr;
+  MSA* msa = nullptr;
+  if (stream_budget > 0) {
+    // If a memory budget is given, stream the alignment from disk and only
+    // keep its statistics. Weights cannot be computed this way, so they have
+    // to be supplied with -w (or stored in a binary alignment).
+    if (reweight) {
+      std::cerr << "ERROR: -r cannot be used with -s. Compute the weights "
+                << "separately and pass them with -w." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (collapse_duplicates) {
+      std::cerr << "ERROR: -u cannot be used with -s. The streamed alignment "
+                << "is read as is, with the weights given with -w."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if ((pos_gap_max >= 0) || (seq_gap_max >= 0)) {
+      std::cerr << "ERROR: -g and -G cannot be used with -s. Filter the "
+                << "alignment beforehand." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    MSAStream msa_stream(numeric_msa_given ? numeric_file : input_file,
+                         weight_file,
+                         numeric_msa_given);
+    msa_stats = new MSAStats(&msa_stream, stream_budget);
+  } else {
+    // Sequence weights are computed after the alignment has been filtered.
+    bool preprocess =
+      collapse_duplicates || (pos_gap_max >= 0) || (seq_gap_max >= 0);
+    bool weights_read = false;
+    if (numeric_msa_given && weight_given) {
+      // If both the numeric matrix and sequence weights are given, don't
+      // bother converting the FASTA file.
+      msa = new MSA(numeric_file, weight_file, numeric_msa_given);
+      weights_read = true;
+    } else if (numeric_msa_given) {
+      msa = new MSA(numeric_file,
+                    reweight && !preprocess,
+                    numeric_msa_given,
+                    threshold);
+    } else if (input_file_given) {
+      // Parse the multiple sequence alignment. Reweight sequences if desired.
+      msa = new MSA(input_file,
+                    reweight && !preprocess,
+                    numeric_msa_given,
+                    threshold);
+    }
 
-    if (dest_dir_given == true) {
-      chdir(dest_dir.c_str());
+    // Drop gappy positions first, so that the sequence filter only counts
+    // gaps at the positions that are kept.
+    if (pos_gap_max >= 0) {
+      int removed = msa->filterPositions(pos_gap_max);
+      std::cout << "removed " << removed << " positions with more than "
+                << pos_gap_max << " gaps (" << msa->N << " kept)" << std::endl;
+      if (msa->N == 0) {
+        std::cerr << "ERROR: all positions have more than " << pos_gap_max
+                  << " gaps. Raise the threshold given with -g." << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      if (is_root) {
+        msa->writePositionMap(dest_dir + "/position_map.txt");
+      }
+    }
+    if (seq_gap_max >= 0) {
+      int removed = msa->filterSequences(seq_gap_max);
+      std::cout << "removed " << removed << " sequences with more than "
+                << seq_gap_max << " gaps (" << msa->M << " kept)" << std::endl;
+      if (msa->M == 0) {
+        std::cerr << "ERROR: all sequences have more than " << seq_gap_max
+                  << " gaps. Raise the threshold given with -G." << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
     }
 
-    sim.writeParameters("bmdca_params.conf");
-    sim.run();
-  } else if (numeric_msa_given) {
-    MSA msa = MSA(numeric_file, reweight, numeric_msa_given, threshold);
-    msa.writeSequenceWeights(dest_dir + "/sequence_weights.txt");
-    msa.writeMatrix(dest_dir + "/msa_numerical.txt");
+    // Collapse identical sequences before the quadratic reweighting step.
+    if (collapse_duplicates) {
+      int removed = msa->collapseDuplicates();
+      std::cout << "collapsed " << removed << " duplicate sequences ("
+                << msa->M << " unique)" << std::endl;
+    }
+    if (preprocess && reweight && !weights_read) {
+      msa->computeSequenceWeights(threshold);
+    }
+    if (is_root) {
+      msa->writeSequenceWeights(dest_dir + "/sequence_weights.txt");
+      if (binary_msa_output) {
+        msa->writeMatrixBinary(dest_dir + "/msa_numerical.bin");
+      } else {
+        msa->writeMatrix(dest_dir + "/msa_numerical.txt");
+      }
+    }
 
     // Compute the statistics of the MSA.
-    MSAStats msa_stats = MSAStats(msa);
-    msa_stats.writeFrequency1p(dest_dir + "/stat_align_1p.txt");
-    msa_stats.writeFrequency2p(dest_dir + "/stat_align_2p.txt");
-    msa_stats.writeRelEntropyGradient(dest_dir + "/rel_ent_grad_align_1p.txt");
-
-    // Initialize the MCMC using the statistics of the MSA.
-    Sim sim = Sim(msa_stats, config_file);
-
-    if (dest_dir_given == true) {
-      chdir(dest_dir.c_str());
+    msa_stats = new MSAStats(*msa);
+    if (!Sim::needsAlignment(config_file, resume)) {
+      delete msa;
+      msa = nullptr;
     }
+  }
+  if (is_root) {
+    msa_stats->writeFrequency1p(dest_dir + "/stat_align_1p.txt");
+    msa_stats->writeFrequency2p(dest_dir + "/stat_align_2p.txt");
+    msa_stats->writeRelEntropyGradient(dest_dir +
+                                       "/rel_ent_grad_align_1p.txt");
+  }
 
-    sim.writeParameters("bmdca_params.conf");
-    sim.run();
-  } else if (input_file_given) {
-    // Parse the multiple sequence alignment. Reweight sequences if desired.
-    MSA msa = MSA(input_file, reweight, numeric_msa_given, threshold);
-    msa.writeSequenceWeights(dest_dir + "/sequence_weights.txt");
-    msa.writeMatrix(dest_dir + "/msa_numerical.txt");
-
-    // Compute the statistics of the MSA.
-    MSAStats msa_stats = MSAStats(msa);
-    msa_stats.writeFrequency1p(dest_dir + "/stat_align_1p.txt");
-    msa_stats.writeFrequency2p(dest_dir + "/stat_align_2p.txt");
-    msa_stats.writeRelEntropyGradient(dest_dir + "/rel_ent_grad_align_1p.txt");
+  // Initialize the MCMC using the statistics of the MSA. The statistics are
+  // moved into the simulation rather than copied.
+  Sim sim(std::move(*msa_stats), config_file);
+  delete msa_stats;
+  if (!resume) {
+    sim.initializeModel(msa);
+  }
+  sim.initializeChains(msa);
+  delete msa;
+  std::cout << "peak memory usage: " << getPeakMemoryUsage() << " MB"
+            << std::endl;
 
-    // Initialize the MCMC using the statistics of the MSA.
-    Sim sim = Sim(msa_stats, config_file);
+  if (dest_dir_given == true) {
+    chdir(dest_dir.c_str());
+  }
 
-    if (dest_dir_given == true) {
-      chdir(dest_dir.c_str());
+  if (quick) {
+    sim.runQuick();
+  } else {
+    if (is_root && !resume) {
+      sim.writeParameters("bmdca_params.conf");
     }
-
-    sim.writeParameters("bmdca_params.conf");
-    sim.run();
+    sim.run(resume);
   }
 
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
+
   return 0;
 };
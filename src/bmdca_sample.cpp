@@ -1,6 +1,7 @@
 #include <armadillo>
 #include <iostream>
 #include <string>
+#include <utility>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,13 +18,14 @@ main(int argc, char* argv[])
   std::string dest_dir = ".";
   std::string config_file;
   std::string output_file = "mcmc_sequences.fasta";
+  std::string seed_file, weight_file;
 
   bool dest_dir_given = false;
   bool compat_mode = true;
 
   // Read command-line parameters.
   char c;
-  while ((c = getopt(argc, argv, "p:h:j:d:n:c:o:r:")) != -1) {
+  while ((c = getopt(argc, argv, "p:h:j:d:n:c:o:r:i:w:")) != -1) {
     switch (c) {
       case 'p':
         parameters_file = optarg;
@@ -58,6 +60,12 @@ main(int argc, char* argv[])
       case 'c':
         config_file = optarg;
         break;
+      case 'i':
+        seed_file = optarg;
+        break;
+      case 'w':
+        weight_file = optarg;
+        break;
       case '?':
         std::cerr << "ERROR: Incorrect command line usage." << std::endl;
         std::exit(EXIT_FAILURE);
@@ -75,13 +83,25 @@ main(int argc, char* argv[])
   int N = params.h.n_cols;
   int Q = params.h.n_rows;
 
-  Generator generator = Generator(params, N, Q, config_file);
+  Generator generator(std::move(params), N, Q, config_file);
+
+  // Seed sequences (e.g. the training alignment, with its sequence weights),
+  // from which the chains start instead of random sequences.
+  MSA* seeds = nullptr;
+  if (!seed_file.empty()) {
+    if (weight_file.empty()) {
+      seeds = new MSA(seed_file, false, false);
+    } else {
+      seeds = new MSA(seed_file, weight_file, false);
+    }
+  }
 
   if (dest_dir_given == true) {
     chdir(dest_dir.c_str());
   }
 
-  generator.run(num_replicates, num_sequences, output_file);
+  generator.run(num_replicates, num_sequences, output_file, seeds);
+  delete seeds;
 
   return 0;
 };
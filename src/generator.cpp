@@ -5,14 +5,15 @@
 #include "pcg_random.hpp"
 #include "utils.hpp"
 
+#include <utility>
+
 Generator::Generator(potts_model params, int n, int q, std::string config_file)
   : N(n)
   , Q(q)
-  , model(params)
+  , model(std::move(params))
 {
-  if (config_file.length() == 0) {
-    initializeParameters();
-  } else {
+  initializeParameters();
+  if (config_file.length() != 0) {
     loadParameters(config_file);
   }
 };
@@ -31,7 +32,12 @@ Generator::initializeParameters(void)
   check_ergo = true;
   adapt_up_time = 1.5;
   adapt_down_time = 0.600;
+  ergo_iat = false;
+  extend_chains = true;
   temperature = 1.0;
+  site_order = "random";
+  block_pairs = 0;
+  block_rate = 0.1;
 };
 
 void
@@ -42,6 +48,20 @@ Generator::checkParameters(void)
     check_ergo = false;
     std::cerr << "WARNING: disabling 'check_ergo' when M=1." << std::endl;
   }
+
+  if ((site_order != "random") && (site_order != "sweep") &&
+      (site_order != "shuffled")) {
+    std::cerr << "ERROR: unknown site order '" << site_order << "'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if (block_pairs < 0) {
+    block_pairs = 0;
+  }
+  if ((block_rate < 0) || (block_rate > 1)) {
+    std::cerr << "ERROR: 'block_rate' must be between 0 and 1." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
 }
 
 void
@@ -97,8 +117,26 @@ Generator::setParameter(std::string key, std::string value)
     adapt_up_time = std::stod(value);
   } else if (key == "adapt_down_time") {
     adapt_down_time = std::stod(value);
+  } else if (key == "ergo_iat") {
+    if (value.size() == 1) {
+      ergo_iat = (std::stoi(value) == 1);
+    } else {
+      ergo_iat = (value == "true");
+    }
+  } else if (key == "extend_chains") {
+    if (value.size() == 1) {
+      extend_chains = (std::stoi(value) == 1);
+    } else {
+      extend_chains = (value == "true");
+    }
   } else if (key == "temperature") {
     temperature = std::stod(value);
+  } else if (key == "site_order") {
+    site_order = value;
+  } else if (key == "block_pairs") {
+    block_pairs = std::stoi(value);
+  } else if (key == "block_rate") {
+    block_rate = std::stod(value);
   }
 };
 
@@ -209,7 +247,10 @@ Generator::convertAA(int n)
 };
 
 void
-Generator::run(int n_indep_runs, int n_per_run, std::string output_file)
+Generator::run(int n_indep_runs,
+               int n_per_run,
+               std::string output_file,
+               const MSA* seeds)
 {
   std::cout << "initializing sampler... " << std::flush;
 
@@ -221,27 +262,70 @@ Generator::run(int n_indep_runs, int n_per_run, std::string output_file)
 
   checkParameters();
 
+  // Start each chain from its own sequence, drawn from the seed sequences.
+  if (seeds != nullptr) {
+    if (seeds->N != N) {
+      std::cerr << "ERROR: seed sequences have " << seeds->N
+                << " positions instead of " << N << "." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    initial_samples = seeds->sampleSequences(count_max, random_seed);
+  }
+
   samples = arma::Cube<int>(M, N, count_max, arma::fill::zeros);
   mcmc = new MCMC(model, N, Q);
+  mcmc->set_site_order(site_order);
+  mcmc->set_block_updates(block_pairs, block_rate);
   mcmc->load(model);
   mcmc_stats = new MCMCStats(&samples, &(model));
 
-  // Instantiate the PCG random number generator and unifrom random
-  // distribution.
-  pcg32 rng(random_seed);
-  std::uniform_int_distribution<long int> dist(0, RAND_MAX - count_max);
-
   std::cout << timer.toc() << " sec" << std::endl << std::endl;
 
   int t_wait = t_wait_0;
   int delta_t = delta_t_0;
   bool flag_mc = true;
+  bool extend = false;
+  std::vector<long int> sample_times;
   int resample_counter = 0;
   while (flag_mc) {
-    std::cout << "sampling model with mcmc... " << std::flush;
-    timer.tic();
-    mcmc->sample(
-      &samples, count_max, M, N, t_wait, delta_t, dist(rng), temperature);
+    long int seed = deriveSeed(random_seed, 0, resample_counter);
+    if (extend) {
+      std::cout << "extending mcmc chains... " << std::flush;
+      timer.tic();
+      mcmc->extend(&samples,
+                   count_max,
+                   M,
+                   t_wait,
+                   delta_t,
+                   &sample_times,
+                   seed,
+                   0,
+                   temperature);
+    } else if (!initial_samples.is_empty()) {
+      std::cout << "sampling model with mcmc... " << std::flush;
+      timer.tic();
+      mcmc->sample_init(&samples,
+                        count_max,
+                        M,
+                        N,
+                        t_wait,
+                        delta_t,
+                        &initial_samples,
+                        seed,
+                        0,
+                        temperature);
+    } else {
+      std::cout << "sampling model with mcmc... " << std::flush;
+      timer.tic();
+      mcmc->sample(
+        &samples, count_max, M, N, t_wait, delta_t, seed, 0, temperature);
+    }
+    if (!extend) {
+      sample_times = std::vector<long int>(M);
+      for (int s = 0; s < M; s++) {
+        sample_times[s] = (long int)t_wait + (long int)(s + 1) * delta_t;
+      }
+    }
     std::cout << timer.toc() << " sec" << std::endl;
 
     std::cout << "updating mcmc stats with samples... " << std::flush;
@@ -249,7 +333,61 @@ Generator::run(int n_indep_runs, int n_per_run, std::string output_file)
     mcmc_stats->updateData(&samples, &model);
     std::cout << timer.toc() << " sec" << std::endl;
 
-    if (check_ergo) {
+    if (check_ergo && ergo_iat) {
+      std::cout << "computing autocorrelation times... " << std::flush;
+      timer.tic();
+      mcmc_stats->computeAutocorrelationTimes();
+      std::cout << timer.toc() << " sec" << std::endl;
+
+      std::vector<double> iat_stats = mcmc_stats->getAutocorrelationStats();
+
+      double tau = iat_stats.at(0);
+      double burn_in = iat_stats.at(3);
+
+      std::cout << "autocorrelation time " << tau << ", effective samples "
+                << iat_stats.at(1) << " (min " << iat_stats.at(2)
+                << " per chain)" << std::endl;
+
+      // Set the wait time to about one autocorrelation time, and extend the
+      // burn-in by the time spent on samples that were not yet equilibrated,
+      // so that a single resampling is usually enough.
+      bool flag_resample = false;
+      int delta_t_sampled = delta_t;
+      if (tau > IAT_INCREASE) {
+        delta_t = (int)(ceil((double)delta_t * tau));
+        std::cout << "increasing wait time to " << delta_t << std::endl;
+        flag_resample = true;
+      } else if (tau < IAT_DECREASE) {
+        delta_t = Max((int)(round((double)delta_t * adapt_down_time)), 1);
+        std::cout << "decreasing wait time to " << delta_t << std::endl;
+      }
+
+      if (burn_in >= 1) {
+        t_wait = t_wait + (int)(ceil(burn_in * delta_t_sampled));
+        std::cout << "increasing burn-in time to " << t_wait << std::endl;
+        if (burn_in > 0.1 * M) {
+          flag_resample = true;
+        }
+      }
+
+      if (not flag_resample) {
+        flag_mc = false;
+      } else {
+        if (resample_counter >= resample_max) {
+          std::cout << "maximum number of resamplings (" << resample_counter
+                    << ") reached. stopping..." << std::endl;
+          flag_mc = false;
+        } else {
+          std::cout << "resampling..." << std::endl;
+          resample_counter++;
+          extend = extend_chains;
+
+          std::cout << "writing temporary files" << std::endl;
+          writeAASequences("temp_" + output_file);
+          writeNumericalSequences("temp_" + output_file);
+        }
+      }
+    } else if (check_ergo) {
       std::cout << "computing sequence energies and correlations... "
                 << std::flush;
       timer.tic();
@@ -317,6 +455,7 @@ Generator::run(int n_indep_runs, int n_per_run, std::string output_file)
         } else {
           std::cout << "resampling..." << std::endl;
           resample_counter++;
+          extend = extend_chains;
 
           std::cout << "writing temporary files" << std::endl;
           writeAASequences("temp_" + output_file);
@@ -1,13 +1,14 @@
 #include "utils.hpp"
 #include "mcmc.hpp"
 #include "mcmc_stats.hpp"
+#include "msa.hpp"
 
 class Generator
 {
 public:
   Generator(potts_model, int, int, std::string);
   ~Generator(void);
-  void run(int, int, std::string);
+  void run(int, int, std::string, const MSA* = nullptr);
   void writeAASequences(std::string);
   void writeNumericalSequences(std::string);
 
@@ -24,9 +25,15 @@ private:
   bool check_ergo;
   double adapt_up_time;
   double adapt_down_time;
+  bool ergo_iat;
+  bool extend_chains;
   double temperature;
+  std::string site_order;
+  int block_pairs;
+  double block_rate;
 
   arma::Cube<int> samples;
+  arma::Mat<int> initial_samples; // initial sequence of each chain, if any
   potts_model model;
 
   MCMC *mcmc;
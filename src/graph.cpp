@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <armadillo>
 #include <cassert>
 #include <cmath>
@@ -9,38 +10,323 @@
 #include <random>
 
 #include "graph.hpp"
-#include "mvector.hpp"
 #include "pcg_random.hpp"
 
 using namespace std;
-using namespace xstd;
 
 std::ostream& log_out = std::cout;
 
 void
-Graph::load(potts_model model)
+Graph::allocate(void)
 {
+  J_offset = vector<size_t>(n * n);
+  h_offset = vector<size_t>(n);
+  size_t J_size = 0;
+  size_t h_size = 0;
+  for (size_t i = 0; i < n; ++i) {
+    h_offset[i] = h_size;
+    h_size += qs[i];
+    for (size_t j = 0; j < n; ++j) {
+      if (j != i) {
+        J_offset[i * n + j] = J_size;
+        J_size += qs[i] * qs[j];
+      }
+    }
+  }
+  J = vector<double>(J_size);
+  h = vector<double>(h_size);
+};
+
+void
+Graph::load(const potts_model& model)
+{
+  arma::Col<int> alphabet_sizes = getAlphabetSizes(model);
+  vector<size_t> model_qs(alphabet_sizes.begin(), alphabet_sizes.end());
+  if (model_qs != qs) {
+    qs = model_qs;
+    allocate();
+  }
+
   for (size_t i = 0; i < n; ++i) {
     for (size_t j = i + 1; j < n; ++j) {
-      vector<double> sumJi(q);
-      vector<double> sumJj(q);
-      for (size_t yi = 0; yi < q; yi++) {
-        for (size_t yj = 0; yj < q; yj++) {
-          J[i][j][yi][yj] = model.J.at(i, j).at(yi, yj);
-          J[j][i][yj][yi] = J[i][j][yi][yj];
-          sumJi[yi] += J[i][j][yi][yj];
-          sumJi[yj] += J[i][j][yi][yj];
+      for (size_t yi = 0; yi < qs[i]; yi++) {
+        for (size_t yj = 0; yj < qs[j]; yj++) {
+          J_at(i, j, yi, yj) = model.J.at(i, j).at(yi, yj);
+          J_at(j, i, yj, yi) = J_at(i, j, yi, yj);
         }
       }
     }
   }
   for (size_t i = 0; i < n; ++i) {
-    double sumh = 0;
-    for (size_t yi = 0; yi < q; ++yi) {
-      h[i][yi] = model.h.at(yi, i);
-      sumh += h[i][yi];
+    for (size_t yi = 0; yi < qs[i]; ++yi) {
+      h_at(i, yi) = model.h.at(yi, i);
+    }
+  }
+  select_blocks();
+};
+
+void
+Graph::set_site_order(std::string order)
+{
+  site_order = order;
+};
+
+void
+Graph::set_block_updates(size_t pairs, double rate)
+{
+  block_pairs = pairs;
+  block_rate = rate;
+  select_blocks();
+};
+
+/*
+ * Select the block_pairs pairs with the largest Frobenius norm of their
+ * (zero-sum gauged) coupling matrix.
+ */
+void
+Graph::select_blocks(void)
+{
+  blocks.clear();
+  if (block_pairs == 0) {
+    return;
+  }
+
+  vector<pair<double, pair<size_t, size_t>>> norms;
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = i + 1; j < n; ++j) {
+      vector<double> row_mean(qs[i], 0);
+      vector<double> col_mean(qs[j], 0);
+      double mean = 0;
+      for (size_t yi = 0; yi < qs[i]; ++yi) {
+        for (size_t yj = 0; yj < qs[j]; ++yj) {
+          double c = J_at(i, j, yi, yj);
+          row_mean[yi] += c / qs[j];
+          col_mean[yj] += c / qs[i];
+          mean += c / (qs[i] * qs[j]);
+        }
+      }
+      double norm = 0;
+      for (size_t yi = 0; yi < qs[i]; ++yi) {
+        for (size_t yj = 0; yj < qs[j]; ++yj) {
+          double c = J_at(i, j, yi, yj) - row_mean[yi] - col_mean[yj] + mean;
+          norm += c * c;
+        }
+      }
+      norms.push_back(make_pair(-norm, make_pair(i, j)));
+    }
+  }
+
+  size_t count = min(block_pairs, norms.size());
+  partial_sort(norms.begin(), norms.begin() + count, norms.end());
+  for (size_t k = 0; k < count; ++k) {
+    blocks.push_back(norms[k].second);
+  }
+};
+
+/*
+ * Run iters MCMC steps, or iters sweeps over the positions if site_order is
+ * not 'random'. Returns the change of energy.
+ */
+double
+Graph::mcmc_steps(vector<size_t>& conf,
+                  size_t iters,
+                  Workspace& work,
+                  pcg32& rng,
+                  uniform_real_distribution<double>& uniform,
+                  double temperature)
+{
+  double de = 0;
+  if (site_order == "random") {
+    for (size_t k = 0; k < iters; ++k) {
+      de += mcmc_step(conf, work, rng, uniform, temperature);
+    }
+  } else {
+    for (size_t k = 0; k < iters; ++k) {
+      de += mcmc_sweep(conf, work, rng, uniform, temperature);
+    }
+  }
+  return de;
+};
+
+/*
+ * One MCMC step: a Metropolis move of a random position, or a block move of a
+ * random strongly coupled pair. Returns the change of energy.
+ */
+double
+Graph::mcmc_step(vector<size_t>& conf,
+                 Workspace& work,
+                 pcg32& rng,
+                 uniform_real_distribution<double>& uniform,
+                 double temperature)
+{
+  if (!blocks.empty() && (uniform(rng) < block_rate)) {
+    return block_step(conf, work.scratch, rng, uniform, temperature);
+  }
+
+  size_t i = size_t(n * uniform(rng));
+  size_t dq = 1 + size_t((qs[i] - 1) * uniform(rng));
+
+  size_t q0 = conf[i];
+  size_t q1 = (q0 + dq) % qs[i];
+
+  double de = energy_change(conf, i, q0, q1);
+  if ((de < 0) || (uniform(rng) < exp(-de / temperature))) {
+    conf[i] = q1;
+    return de;
+  }
+  return 0;
+};
+
+/*
+ * One sweep: a Metropolis move at each position, in order ('sweep') or in a
+ * new random order ('shuffled'), followed by block_rate * n block moves. The
+ * random numbers of the position moves are drawn together, before the sweep.
+ * Returns the change of energy.
+ */
+double
+Graph::mcmc_sweep(vector<size_t>& conf,
+                  Workspace& work,
+                  pcg32& rng,
+                  uniform_real_distribution<double>& uniform,
+                  double temperature)
+{
+  bool shuffled = (site_order == "shuffled");
+  if (work.order.size() != n) {
+    work.order.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      work.order[i] = i;
+    }
+  }
+  work.uniforms.resize(shuffled ? 3 * n : 2 * n);
+  for (size_t k = 0; k < work.uniforms.size(); ++k) {
+    work.uniforms[k] = uniform(rng);
+  }
+  const double* u_dq = work.uniforms.data();
+  const double* u_accept = u_dq + n;
+  if (shuffled) {
+    const double* u_order = u_accept + n;
+    for (size_t k = n - 1; k > 0; --k) {
+      swap(work.order[k], work.order[size_t((k + 1) * u_order[k])]);
+    }
+  }
+
+  double tot_de = 0;
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = work.order[k];
+    size_t dq = 1 + size_t((qs[i] - 1) * u_dq[k]);
+
+    size_t q0 = conf[i];
+    size_t q1 = (q0 + dq) % qs[i];
+
+    double de = energy_change(conf, i, q0, q1);
+    if ((de < 0) || (u_accept[k] < exp(-de / temperature))) {
+      conf[i] = q1;
+      tot_de += de;
+    }
+  }
+
+  if (!blocks.empty()) {
+    size_t block_moves = size_t(block_rate * n + 0.5);
+    for (size_t k = 0; k < block_moves; ++k) {
+      tot_de += block_step(conf, work.scratch, rng, uniform, temperature);
+    }
+  }
+  return tot_de;
+};
+
+/*
+ * Change of energy when position i of conf goes from state q0 to q1.
+ */
+double
+Graph::energy_change(const vector<size_t>& conf,
+                     size_t i,
+                     size_t q0,
+                     size_t q1)
+{
+  double e0 = -h_at(i, q0);
+  for (size_t j = 0; j < n; ++j)
+    if (j != i) {
+      e0 -= J_at(i, j, q0, conf[j]);
+    }
+  double e1 = -h_at(i, q1);
+  for (size_t j = 0; j < n; ++j)
+    if (j != i) {
+      e1 -= J_at(i, j, q1, conf[j]);
     }
+  return e1 - e0;
+};
+
+/*
+ * Heat-bath move of a pair (i, j) of blocks: draws (conf[i], conf[j]) from
+ * their distribution given the other positions, with the local fields of both
+ * positions and their coupling block tabulated in scratch.
+ */
+double
+Graph::block_step(vector<size_t>& conf,
+                  vector<double>& scratch,
+                  pcg32& rng,
+                  uniform_real_distribution<double>& uniform,
+                  double temperature)
+{
+  const pair<size_t, size_t>& block =
+    blocks[size_t(blocks.size() * uniform(rng))];
+  size_t i = block.first;
+  size_t j = block.second;
+
+  size_t size = qs[i] + qs[j] + qs[i] * qs[j];
+  if (scratch.size() < size) {
+    scratch.resize(size);
+  }
+  double* f_i = scratch.data();
+  double* f_j = f_i + qs[i];
+  double* table = f_j + qs[j];
+
+  for (size_t yi = 0; yi < qs[i]; ++yi) {
+    f_i[yi] = h_at(i, yi);
   }
+  for (size_t yj = 0; yj < qs[j]; ++yj) {
+    f_j[yj] = h_at(j, yj);
+  }
+  for (size_t k = 0; k < n; ++k) {
+    if ((k != i) && (k != j)) {
+      for (size_t yi = 0; yi < qs[i]; ++yi) {
+        f_i[yi] += J_at(i, k, yi, conf[k]);
+      }
+      for (size_t yj = 0; yj < qs[j]; ++yj) {
+        f_j[yj] += J_at(j, k, yj, conf[k]);
+      }
+    }
+  }
+
+  // Negative energies of all the states of the pair, then their weights.
+  double e_max = -INFINITY;
+  for (size_t yi = 0; yi < qs[i]; ++yi) {
+    for (size_t yj = 0; yj < qs[j]; ++yj) {
+      double e = f_i[yi] + f_j[yj] + J_at(i, j, yi, yj);
+      table[yi * qs[j] + yj] = e;
+      e_max = max(e_max, e);
+    }
+  }
+  size_t y0 = conf[i] * qs[j] + conf[j];
+  double e0 = table[y0];
+  double z = 0;
+  for (size_t y = 0; y < qs[i] * qs[j]; ++y) {
+    table[y] = exp((table[y] - e_max) / temperature);
+    z += table[y];
+  }
+
+  double r = z * uniform(rng);
+  size_t y1 = 0;
+  for (; y1 + 1 < qs[i] * qs[j]; ++y1) {
+    r -= table[y1];
+    if (r < 0) {
+      break;
+    }
+  }
+  double e1 = e_max + temperature * log(table[y1]);
+  conf[i] = y1 / qs[j];
+  conf[j] = y1 % qs[j];
+  return e0 - e1;
 };
 
 ostream&
@@ -52,16 +338,16 @@ Graph::print_distribution(ostream& os)
   while (true) {
     double x = 0;
     for (size_t i = 0; i < n; ++i) {
-      x += h[i][conf[i]];
+      x += h_at(i, conf[i]);
     }
     for (size_t i = 0; i < n; ++i) {
       for (size_t j = i + 1; j < n; ++j) {
-        x += J[i][j][conf[i]][conf[j]];
+        x += J_at(i, j, conf[i], conf[j]);
       }
     }
     norm += exp(x);
     size_t j = 0;
-    while (j < n && ++conf[j] == q) {
+    while (j < n && ++conf[j] == qs[j]) {
       conf[j] = 0;
       j++;
     }
@@ -72,16 +358,16 @@ Graph::print_distribution(ostream& os)
   while (true) {
     double x = 0;
     for (size_t i = 0; i < n; ++i) {
-      x += h[i][conf[i]];
+      x += h_at(i, conf[i]);
     }
     for (size_t i = 0; i < n; ++i) {
       for (size_t j = i + 1; j < n; ++j) {
-        x += J[i][j][conf[i]][conf[j]];
+        x += J_at(i, j, conf[i], conf[j]);
       }
     }
     os << "G2 " << exp(x) / norm << endl;
     size_t j = 0;
-    while (j < n && ++conf[j] == q) {
+    while (j < n && ++conf[j] == qs[j]) {
       conf[j] = 0;
       j++;
     }
@@ -166,76 +452,34 @@ Graph::sample_mcmc(arma::Mat<int>* ptr,
                    size_t mc_iters0,
                    size_t mc_iters,
                    long int seed,
+                   long int stream,
                    double temperature)
 {
-  pcg32 rng(seed);
+  pcg32 rng(seed, stream);
   std::uniform_real_distribution<> uniform(0, 1);
 
   size_t ts = 0;
   vector<size_t> conf(n);
   for (size_t i = 0; i < n; ++i) {
-    conf[i] = size_t(q * uniform(rng));
-    assert(conf[i] < q);
+    conf[i] = size_t(qs[i] * uniform(rng));
+    assert(conf[i] < qs[i]);
   }
 
   double en = 0.;
   for (size_t i = 0; i < n; ++i) {
-    en -= h[i][conf[i]];
+    en -= h_at(i, conf[i]);
     for (size_t j = i + 1; j < n; ++j) {
-      en -= J[i][j][conf[i]][conf[j]];
+      en -= J_at(i, j, conf[i], conf[j]);
     }
   }
 
   double tot_de = 0;
-  for (size_t k = 0; k < mc_iters0; ++k) {
-    size_t i = size_t(n * uniform(rng));
-    size_t dq = 1 + size_t((q - 1) * uniform(rng));
-
-    size_t q0 = conf[i];
-    size_t q1 = (q0 + dq) % q;
-
-    double e0 = -h[i][q0];
-    for (size_t j = 0; j < n; ++j)
-      if (j != i) {
-        e0 -= J[i][j][q0][conf[j]];
-      }
-    double e1 = -h[i][q1];
-    for (size_t j = 0; j < n; ++j)
-      if (j != i) {
-        e1 -= J[i][j][q1][conf[j]];
-      }
-    double de = e1 - e0;
-    if ((de < 0) || (uniform(rng) < exp(-de / temperature))) {
-      conf[i] = q1;
-      tot_de += de;
-    }
-  }
+  Workspace work;
+  tot_de += mcmc_steps(conf, mc_iters0, work, rng, uniform, temperature);
   en += tot_de;
   tot_de = 0.;
   for (size_t s = 0; s < m; ++s) {
-    for (size_t k = 0; k < mc_iters; ++k) {
-      size_t i = size_t(n * uniform(rng));
-      size_t dq = 1 + size_t((q - 1) * uniform(rng));
-
-      size_t q0 = conf[i];
-      size_t q1 = (q0 + dq) % q;
-
-      double e0 = -h[i][q0];
-      for (size_t j = 0; j < n; ++j)
-        if (j != i) {
-          e0 -= J[i][j][q0][conf[j]];
-        }
-      double e1 = -h[i][q1];
-      for (size_t j = 0; j < n; ++j)
-        if (j != i) {
-          e1 -= J[i][j][q1][conf[j]];
-        }
-      double de = e1 - e0;
-      if ((de < 0) || (uniform(rng) < exp(-de / temperature))) {
-        conf[i] = q1;
-        tot_de += de;
-      }
-    }
+    tot_de += mcmc_steps(conf, mc_iters, work, rng, uniform, temperature);
     for (size_t i = 0; i < n; ++i) {
       (*ptr).at(s, i) = conf[i];
     }
@@ -253,76 +497,34 @@ Graph::sample_mcmc_init(arma::Mat<int>* ptr,
                         size_t mc_iters,
                         arma::Col<int>* init_ptr,
                         long int seed,
+                        long int stream,
                         double temperature)
 {
-  pcg32 rng(seed);
+  pcg32 rng(seed, stream);
   std::uniform_real_distribution<> uniform(0, 1);
 
   size_t ts = 0;
   vector<size_t> conf(n);
   for (size_t i = 0; i < n; ++i) {
-    conf[i] = (*ptr).at(i);
-    assert(conf[i] < q);
+    conf[i] = (*init_ptr).at(i);
+    assert(conf[i] < qs[i]);
   }
 
   double en = 0.;
   for (size_t i = 0; i < n; ++i) {
-    en -= h[i][conf[i]];
+    en -= h_at(i, conf[i]);
     for (size_t j = i + 1; j < n; ++j) {
-      en -= J[i][j][conf[i]][conf[j]];
+      en -= J_at(i, j, conf[i], conf[j]);
     }
   }
 
   double tot_de = 0;
-  for (size_t k = 0; k < mc_iters0; ++k) {
-    size_t i = size_t(n * uniform(rng));
-    size_t dq = 1 + size_t((q - 1) * uniform(rng));
-
-    size_t q0 = conf[i];
-    size_t q1 = (q0 + dq) % q;
-
-    double e0 = -h[i][q0];
-    for (size_t j = 0; j < n; ++j)
-      if (j != i) {
-        e0 -= J[i][j][q0][conf[j]];
-      }
-    double e1 = -h[i][q1];
-    for (size_t j = 0; j < n; ++j)
-      if (j != i) {
-        e1 -= J[i][j][q1][conf[j]];
-      }
-    double de = e1 - e0;
-    if ((de < 0) || (uniform(rng) < exp(-de / temperature))) {
-      conf[i] = q1;
-      tot_de += de;
-    }
-  }
+  Workspace work;
+  tot_de += mcmc_steps(conf, mc_iters0, work, rng, uniform, temperature);
   en += tot_de;
   tot_de = 0.;
   for (size_t s = 0; s < m; ++s) {
-    for (size_t k = 0; k < mc_iters; ++k) {
-      size_t i = size_t(n * uniform(rng));
-      size_t dq = 1 + size_t((q - 1) * uniform(rng));
-
-      size_t q0 = conf[i];
-      size_t q1 = (q0 + dq) % q;
-
-      double e0 = -h[i][q0];
-      for (size_t j = 0; j < n; ++j)
-        if (j != i) {
-          e0 -= J[i][j][q0][conf[j]];
-        }
-      double e1 = -h[i][q1];
-      for (size_t j = 0; j < n; ++j)
-        if (j != i) {
-          e1 -= J[i][j][q1][conf[j]];
-        }
-      double de = e1 - e0;
-      if ((de < 0) || (uniform(rng) < exp(-de / temperature))) {
-        conf[i] = q1;
-        tot_de += de;
-      }
-    }
+    tot_de += mcmc_steps(conf, mc_iters, work, rng, uniform, temperature);
     for (size_t i = 0; i < n; ++i) {
       (*ptr)(s, i) = conf[i];
     }
@@ -333,24 +535,66 @@ Graph::sample_mcmc_init(arma::Mat<int>* ptr,
   return;
 };
 
+/*
+ * Continue a chain sampled by sample_mcmc() from its last configuration (the
+ * last row of ptr). The rows listed in keep are moved, in order, to the front
+ * of the chain, and the remaining rows are filled with new samples, the first
+ * after mc_iters0 + mc_iters steps and the next ones mc_iters steps apart.
+ */
+void
+Graph::sample_mcmc_extend(arma::Mat<int>* ptr,
+                          const std::vector<size_t>& keep,
+                          size_t mc_iters0,
+                          size_t mc_iters,
+                          long int seed,
+                          long int stream,
+                          double temperature)
+{
+  pcg32 rng(seed, stream);
+  std::uniform_real_distribution<> uniform(0, 1);
+
+  size_t m = (*ptr).n_rows;
+  vector<size_t> conf(n);
+  for (size_t i = 0; i < n; ++i) {
+    conf[i] = (*ptr).at(m - 1, i);
+    assert(conf[i] < qs[i]);
+  }
+
+  for (size_t s = 0; s < keep.size(); ++s) {
+    for (size_t i = 0; i < n; ++i) {
+      (*ptr).at(s, i) = (*ptr).at(keep[s], i);
+    }
+  }
+
+  Workspace work;
+  mcmc_steps(conf, mc_iters0, work, rng, uniform, temperature);
+  for (size_t s = keep.size(); s < m; ++s) {
+    mcmc_steps(conf, mc_iters, work, rng, uniform, temperature);
+    for (size_t i = 0; i < n; ++i) {
+      (*ptr).at(s, i) = conf[i];
+    }
+  }
+  return;
+};
+
 ostream&
 Graph::print_parameters(ostream& os)
 {
   log_out << "printing parameters J" << endl;
   for (size_t i = 0; i < n; ++i) {
     for (size_t j = i + 1; j < n; ++j) {
-      for (size_t yi = 0; yi < q; ++yi) {
-        for (size_t yj = 0; yj < q; ++yj) {
+      for (size_t yi = 0; yi < qs[i]; ++yi) {
+        for (size_t yj = 0; yj < qs[j]; ++yj) {
           os << "J " << i << " " << j << " " << yi << " " << yj << " "
-             << J[i][j][yi][yj] << endl;
+             << J_at(i, j, yi, yj) << endl;
         }
       }
     }
   }
   log_out << "printing parameters H" << endl;
   for (size_t i = 0; i < n; ++i) {
-    for (size_t yi = 0; yi < q; ++yi) {
-      os << "h " << i << " " << yi << " " << h[i][yi] << endl;
+    for (size_t yi = 0; yi < qs[i]; ++yi) {
+      os << "h " << i << " " << yi << " " << h_at(i, yi) << endl;
     }
   }
   log_out << "done" << endl;
@@ -363,17 +607,17 @@ Graph::print_parameters(FILE* of)
   log_out << "printing parameters J" << endl;
   for (size_t i = 0; i < n; ++i) {
     for (size_t j = i + 1; j < n; ++j) {
-      for (size_t yi = 0; yi < q; ++yi) {
-        for (size_t yj = 0; yj < q; ++yj) {
-          fprintf(of, "J %lu %lu %lu %lu %g\n", i, j, yi, yj, J[i][j][yi][yj]);
+      for (size_t yi = 0; yi < qs[i]; ++yi) {
+        for (size_t yj = 0; yj < qs[j]; ++yj) {
+          fprintf(of, "J %lu %lu %lu %lu %g\n", i, j, yi, yj, J_at(i, j, yi, yj));
         }
       }
     }
   }
   log_out << "printing parameters H" << endl;
   for (size_t i = 0; i < n; ++i) {
-    for (size_t yi = 0; yi < q; ++yi) {
-      fprintf(of, "h %lu %lu %g\n", i, yi, h[i][yi]);
+    for (size_t yi = 0; yi < qs[i]; ++yi) {
+      fprintf(of, "h %lu %lu %g\n", i, yi, h_at(i, yi));
     }
   }
   log_out << "done" << endl;
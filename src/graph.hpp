@@ -3,9 +3,11 @@
 
 #include <armadillo>
 #include <iostream>
+#include <random>
 #include <string>
+#include <vector>
 
-#include "mvector.hpp"
+#include "pcg_random.hpp"
 #include "utils.hpp"
 
 class Graph
@@ -14,14 +16,44 @@ public:
   Graph(size_t n, size_t q)
     : n(n)
     , q(q)
-    , J(xstd::mshape<4>(n, n, q, q))
-    , h(xstd::mshape<2>(n, q)){};
+    , qs(n, q)
+  {
+    allocate();
+  };
 
-  void load(potts_model);
+  void load(const potts_model&);
+
+  void set_site_order(std::string order);
+  void set_block_updates(size_t pairs, double rate);
 
   size_t n, q;
-  xstd::mvector<4, double> J;
-  xstd::mvector<2, double> h;
+  std::vector<size_t> qs; // number of states at each position
+
+  // Couplings and fields are stored flat, so that positions can have
+  // different numbers of states. The (i, j) coupling block is qs[i] x qs[j]
+  // and row-major, and is stored for both i < j and i > j.
+  std::vector<double> J;
+  std::vector<double> h;
+  std::vector<size_t> J_offset;
+  std::vector<size_t> h_offset;
+
+  double& J_at(size_t i, size_t j, size_t yi, size_t yj)
+  {
+    return J[J_offset[i * n + j] + yi * qs[j] + yj];
+  };
+  double& h_at(size_t i, size_t yi) { return h[h_offset[i] + yi]; };
+
+  // Site order: 'random' (a random position at each step), or each position
+  // once per sweep, in order ('sweep') or in a random order ('shuffled'). With
+  // sweeps, burn-in and wait times are numbers of sweeps.
+  std::string site_order = "random";
+
+  // Block updates: with probability block_rate, a MCMC step resamples the two
+  // positions of one of the block_pairs most strongly coupled pairs (selected
+  // at load) jointly from their conditional distribution.
+  size_t block_pairs = 0;
+  double block_rate = 0;
+  std::vector<std::pair<size_t, size_t>> blocks;
 
   std::ostream& print_distribution(std::ostream& os);
 
@@ -34,6 +66,7 @@ public:
                    size_t mc_iters0,
                    size_t mc_iters,
                    long int seed,
+                   long int stream,
                    double temperature = 1.0);
 
   void sample_mcmc_init(arma::Mat<int>* ptr,
@@ -42,9 +75,55 @@ public:
                         size_t mc_iters,
                         arma::Col<int>* init_ptr,
                         long int seed,
+                        long int stream,
                         double temperature = 1.0);
 
+  void sample_mcmc_extend(arma::Mat<int>* ptr,
+                          const std::vector<size_t>& keep,
+                          size_t mc_iters0,
+                          size_t mc_iters,
+                          long int seed,
+                          long int stream,
+                          double temperature = 1.0);
+
   void print_parameters(FILE* of);
+
+private:
+  // Buffers of a chain, reused between its steps.
+  struct Workspace
+  {
+    std::vector<double> scratch;  // pair table of block moves
+    std::vector<double> uniforms; // random numbers of a sweep
+    std::vector<size_t> order;    // positions in the order of a sweep
+  };
+
+  void allocate(void);
+  void select_blocks(void);
+  double mcmc_steps(std::vector<size_t>& conf,
+                    size_t iters,
+                    Workspace& work,
+                    pcg32& rng,
+                    std::uniform_real_distribution<double>& uniform,
+                    double temperature);
+  double mcmc_step(std::vector<size_t>& conf,
+                   Workspace& work,
+                   pcg32& rng,
+                   std::uniform_real_distribution<double>& uniform,
+                   double temperature);
+  double block_step(std::vector<size_t>& conf,
+                    std::vector<double>& scratch,
+                    pcg32& rng,
+                    std::uniform_real_distribution<double>& uniform,
+                    double temperature);
+  double mcmc_sweep(std::vector<size_t>& conf,
+                    Workspace& work,
+                    pcg32& rng,
+                    std::uniform_real_distribution<double>& uniform,
+                    double temperature);
+  double energy_change(const std::vector<size_t>& conf,
+                       size_t i,
+                       size_t q0,
+                       size_t q1);
 };
 
 #endif
@@ -5,11 +5,23 @@
 #include "graph.hpp"
 
 void
-MCMC::load(potts_model model)
+MCMC::load(const potts_model& model)
 {
   graph.load(model);
 };
 
+void
+MCMC::set_site_order(std::string order)
+{
+  graph.set_site_order(order);
+};
+
+void
+MCMC::set_block_updates(int pairs, double rate)
+{
+  graph.set_block_updates(pairs > 0 ? pairs : 0, rate);
+};
+
 MCMC::MCMC(size_t N, size_t Q)
   : graph(N, Q)
 {
@@ -17,7 +29,7 @@ MCMC::MCMC(size_t N, size_t Q)
   q = Q;
 };
 
-MCMC::MCMC(potts_model params, size_t N, size_t Q)
+MCMC::MCMC(const potts_model& params, size_t N, size_t Q)
   : graph(N, Q)
 {
   n = N;
@@ -25,6 +37,11 @@ MCMC::MCMC(potts_model params, size_t N, size_t Q)
   graph.load(params);
 };
 
+/*
+ * Sample M samples of each of reps chains, in parallel. Replicate rep draws its
+ * random numbers from PCG stream stream + rep of seed, so the samples do not
+ * depend on the number of threads or on the other replicates.
+ */
 void
 MCMC::sample(arma::Cube<int>* ptr,
              int reps,
@@ -33,6 +50,7 @@ MCMC::sample(arma::Cube<int>* ptr,
              int t_wait,
              int delta_t,
              long int seed,
+             int stream,
              double temperature){
 #pragma omp parallel
   {
@@ -42,12 +60,17 @@ MCMC::sample(arma::Cube<int>* ptr,
                                    M,
                                    t_wait,
                                    delta_t,
-                                   seed + rep,
+                                   seed,
+                                   stream + rep,
                                    temperature);
     }
   }
 };
 
+/*
+ * Sample as sample(), but start replicate rep from column rep of init_ptr
+ * instead of a random sequence.
+ */
 void
 MCMC::sample_init(arma::Cube<int>* ptr,
                   int reps,
@@ -55,20 +78,131 @@ MCMC::sample_init(arma::Cube<int>* ptr,
                   int N,
                   int t_wait,
                   int delta_t,
-                  arma::Col<int>* init_ptr,
+                  arma::Mat<int>* init_ptr,
                   long int seed,
+                  int stream,
                   double temperature){
 #pragma omp parallel
   {
 #pragma omp for
-    for (int rep = 0; rep < reps;
-         rep++){ graph.sample_mcmc_init((arma::Mat<int>*)&((*ptr).slice(rep)),
-                                        M,
-                                        t_wait,
-                                        delta_t,
-                                        init_ptr,
-                                        seed + rep,
-                                        temperature);
+    for (int rep = 0; rep < reps; rep++) {
+      arma::Col<int> init = (*init_ptr).col(rep);
+      graph.sample_mcmc_init((arma::Mat<int>*)&((*ptr).slice(rep)),
+                             M,
+                             t_wait,
+                             delta_t,
+                             &init,
+                             seed,
+                             stream + rep,
+                             temperature);
+    }
+  }
+};
+
+/*
+ * Continue the chains of a previous call to sample(), sample_init() or
+ * extend(), whose samples were drawn at sample_times (in MC steps from the
+ * start of the chains), so that they are at least t_wait + delta_t steps from
+ * the start and delta_t steps apart. The samples that already are stay at the
+ * front of each chain, and the others are drawn by continuing the chains from
+ * their last configuration, so that burn-in is not paid again. sample_times is
+ * updated with the times of the new samples.
+ */
+void
+MCMC::extend(arma::Cube<int>* ptr,
+             int reps,
+             int M,
+             int t_wait,
+             int delta_t,
+             std::vector<long int>* sample_times,
+             long int seed,
+             int stream,
+             double temperature)
+{
+  std::vector<size_t> keep;
+  long int next = (long int)t_wait + delta_t;
+  for (int s = 0; s < M; s++) {
+    if (sample_times->at(s) >= next) {
+      keep.push_back(s);
+      next = sample_times->at(s) + delta_t;
+    }
+  }
+
+  long int t_end = sample_times->at(M - 1);
+  long int t_extra = next - delta_t - t_end;
+  if (t_extra < 0) {
+    t_extra = 0;
+  }
+  for (int s = 0; s < (int)keep.size(); s++) {
+    sample_times->at(s) = sample_times->at(keep[s]);
+  }
+  for (int s = keep.size(); s < M; s++) {
+    sample_times->at(s) = t_end + t_extra + (s - keep.size() + 1) * delta_t;
+  }
+
+#pragma omp parallel
+  {
+#pragma omp for
+    for (int rep = 0; rep < reps; rep++) {
+      graph.sample_mcmc_extend((arma::Mat<int>*)&((*ptr).slice(rep)),
+                               keep,
+                               t_extra,
+                               delta_t,
+                               seed,
+                               stream + rep,
+                               temperature);
+    }
+  }
+};
+
+/*
+ * Continue each chain from its last configuration (the last row of its
+ * slice), and replace its samples with new ones, the first after t_wait +
+ * delta_t steps and the next ones delta_t steps apart.
+ */
+void
+MCMC::sample_continue(arma::Cube<int>* ptr,
+                      int reps,
+                      int t_wait,
+                      int delta_t,
+                      long int seed,
+                      int stream,
+                      double temperature)
+{
+  std::vector<size_t> keep;
+#pragma omp parallel
+  {
+#pragma omp for
+    for (int rep = 0; rep < reps; rep++) {
+      graph.sample_mcmc_extend((arma::Mat<int>*)&((*ptr).slice(rep)),
+                               keep,
+                               t_wait,
+                               delta_t,
+                               seed,
+                               stream + rep,
+                               temperature);
     }
   }
 };
+
+/*
+ * Sample a single chain on the calling thread, starting from init_ptr if it
+ * is given.
+ */
+void
+MCMC::sample_chain(arma::Mat<int>* ptr,
+                   int M,
+                   int t_wait,
+                   int delta_t,
+                   arma::Col<int>* init_ptr,
+                   long int seed,
+                   int stream,
+                   double temperature)
+{
+  if (init_ptr == nullptr) {
+    graph.sample_mcmc(ptr, M, t_wait, delta_t, seed, stream, temperature);
+  } else {
+    graph.sample_mcmc_init(
+      ptr, M, t_wait, delta_t, init_ptr, seed, stream, temperature);
+  }
+};
@@ -2,6 +2,7 @@
 #define MCMC_HPP
 
 #include <string>
+#include <vector>
 #include <unistd.h>
 
 #include "graph.hpp"
@@ -12,19 +13,54 @@ class MCMC
 
 public:
   MCMC(size_t N, size_t Q);
-  MCMC(potts_model, size_t N, size_t Q);
-  void load(potts_model);
+  MCMC(const potts_model&, size_t N, size_t Q);
+  void load(const potts_model&);
+  void set_site_order(std::string);
+  void set_block_updates(int, double);
   void run(int, int);
-  void sample(arma::Cube<int>*, int, int, int, int, int, long int, double);
+  void sample(arma::Cube<int>*,
+              int,
+              int,
+              int,
+              int,
+              int,
+              long int,
+              int,
+              double);
   void sample_init(arma::Cube<int>*,
                    int,
                    int,
                    int,
                    int,
                    int,
-                   arma::Col<int>*,
+                   arma::Mat<int>*,
                    long int,
+                   int,
                    double);
+  void extend(arma::Cube<int>*,
+              int,
+              int,
+              int,
+              int,
+              std::vector<long int>*,
+              long int,
+              int,
+              double);
+  void sample_continue(arma::Cube<int>*,
+                       int,
+                       int,
+                       int,
+                       long int,
+                       int,
+                       double);
+  void sample_chain(arma::Mat<int>*,
+                    int,
+                    int,
+                    int,
+                    arma::Col<int>*,
+                    long int,
+                    int,
+                    double);
 
 private:
   size_t n; // number of positions
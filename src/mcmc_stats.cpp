@@ -9,6 +9,10 @@
 #define AA_ALPHABET_SIZE 21
 #endif
 
+// Sokal's window: autocorrelations are summed up to the first lag that is at
+// least this multiple of the running estimate of the autocorrelation time.
+#define SOKAL_WINDOW 5
+
 MCMCStats::MCMCStats(arma::Cube<int>* s, potts_model* p)
 {
   M = s->n_rows;
@@ -18,17 +22,23 @@ MCMCStats::MCMCStats(arma::Cube<int>* s, potts_model* p)
 
   samples = s;
   params = p;
+  alphabet_sizes = getAlphabetSizes(*params);
+  lazy_sigma = false;
 
   computeEnergies();
 };
 
 void
-MCMCStats::updateData(arma::Cube<int>* s, potts_model* p)
+MCMCStats::updateData(arma::Cube<int>* s, potts_model* p, bool energies)
 {
+  M = s->n_rows;
   samples = s;
   params = p;
+  alphabet_sizes = getAlphabetSizes(*params);
 
-  computeEnergies();
+  if (energies) {
+    computeEnergies();
+  }
 };
 
 void
@@ -172,6 +182,135 @@ MCMCStats::computeCorrelations(void)
   err_check_auto = sqrt(pow(sigma_check, 2) + pow(sigma_auto, 2)) / sqrt(reps);
 };
 
+/*
+ * Estimate, for each replicate, the integrated autocorrelation times of the
+ * sample energies and of the overlaps between samples, the effective number of
+ * independent samples, and the number of leading samples that are not yet
+ * equilibrated.
+ *
+ * The overlap autocorrelation at lag k is the mean overlap of samples k apart,
+ * less the overlap expected between independent samples (from the state
+ * frequencies of all replicates), normalized by its value at lag 0. The
+ * burn-in is the truncation that minimizes the marginal standard error of the
+ * mean energy (MSER), searched over the first half of the chain. Both series
+ * are then summed, from the end of the burn-in, up to Sokal's window and at
+ * most half the remaining samples.
+ */
+void
+MCMCStats::computeAutocorrelationTimes(void)
+{
+  autocorrelation = arma::Mat<double>(reps, 4, arma::fill::zeros);
+
+  double overlap_indep = 0;
+  arma::Col<double> counts = arma::Col<double>(Q);
+  for (int i = 0; i < N; i++) {
+    counts.zeros();
+    for (int rep = 0; rep < reps; rep++) {
+      for (int m = 0; m < M; m++) {
+        counts.at(samples->at(m, i, rep)) += 1;
+      }
+    }
+    for (int a = 0; a < Q; a++) {
+      overlap_indep += pow(counts.at(a) / (M * reps), 2);
+    }
+  }
+  overlap_indep /= N;
+
+#pragma omp parallel for
+  for (int rep = 0; rep < reps; rep++) {
+    arma::Row<double> e = energies.row(rep);
+
+    // Burn-in (MSER)
+    int burn_in = 0;
+    double sum = 0;
+    double sum2 = 0;
+    double mser_min = -1;
+    for (int d = M - 1; d >= 0; d--) {
+      sum += e.at(d);
+      sum2 += e.at(d) * e.at(d);
+      if (d <= M / 2) {
+        double n = M - d;
+        double mser = (sum2 - sum * sum / n) / (n * n);
+        if ((mser_min < 0) || (mser <= mser_min)) {
+          mser_min = mser;
+          burn_in = d;
+        }
+      }
+    }
+    int n = M - burn_in;
+
+    double e_avg = 0;
+    double e_var = 0;
+    for (int m = burn_in; m < M; m++) {
+      e_avg += e.at(m);
+    }
+    e_avg /= n;
+    for (int m = burn_in; m < M; m++) {
+      e_var += pow(e.at(m) - e_avg, 2);
+    }
+    e_var /= n;
+
+    // Energy autocorrelation time
+    double tau_energy = 1;
+    if (e_var > 0) {
+      for (int k = 1; k < n / 2; k++) {
+        double c = 0;
+        for (int m = burn_in; m < M - k; m++) {
+          c += (e.at(m) - e_avg) * (e.at(m + k) - e_avg);
+        }
+        tau_energy += 2 * c / ((n - k) * e_var);
+        if (k >= SOKAL_WINDOW * tau_energy) {
+          break;
+        }
+      }
+    }
+
+    // Overlap autocorrelation time
+    double tau_overlap = 1;
+    if (overlap_indep < 1) {
+      for (int k = 1; k < n / 2; k++) {
+        int id = 0;
+        for (int m = burn_in; m < M - k; m++) {
+          for (int i = 0; i < N; i++) {
+            if (samples->at(m, i, rep) == samples->at(m + k, i, rep)) {
+              id++;
+            }
+          }
+        }
+        double overlap = (double)id / ((double)N * (n - k));
+        tau_overlap += 2 * (overlap - overlap_indep) / (1 - overlap_indep);
+        if (k >= SOKAL_WINDOW * tau_overlap) {
+          break;
+        }
+      }
+    }
+
+    tau_energy = Max(tau_energy, 1.0);
+    tau_overlap = Max(tau_overlap, 1.0);
+
+    autocorrelation.at(rep, 0) = tau_energy;
+    autocorrelation.at(rep, 1) = tau_overlap;
+    autocorrelation.at(rep, 2) = n / Max(tau_energy, tau_overlap);
+    autocorrelation.at(rep, 3) = burn_in;
+  }
+};
+
+/*
+ * Write the autocorrelation statistics of each replicate: energy and overlap
+ * autocorrelation times, effective sample size and burn-in samples.
+ */
+void
+MCMCStats::writeAutocorrelationStats(std::string output_file)
+{
+  std::ofstream output_stream(output_file);
+  for (int rep = 0; rep < reps; rep++) {
+    output_stream << rep << " " << autocorrelation.at(rep, 0) << " "
+                  << autocorrelation.at(rep, 1) << " "
+                  << autocorrelation.at(rep, 2) << " "
+                  << autocorrelation.at(rep, 3) << std::endl;
+  }
+};
+
 void
 MCMCStats::writeCorrelationsStats(std::string overlap_file,
                                   std::string overlap_inf_file,
@@ -219,72 +358,157 @@ MCMCStats::getCorrelationsStats(void)
   return values;
 };
 
+/*
+ * Summarize the autocorrelation statistics over replicates: the pooled
+ * autocorrelation time (equilibrated samples per effective sample), the total
+ * and the smallest effective sample sizes, and the mean burn-in.
+ */
+std::vector<double>
+MCMCStats::getAutocorrelationStats(void)
+{
+  double ess_tot = 0;
+  double ess_min = autocorrelation.at(0, 2);
+  double burn_in_avg = 0;
+  for (int rep = 0; rep < reps; rep++) {
+    ess_tot += autocorrelation.at(rep, 2);
+    ess_min = Min(ess_min, autocorrelation.at(rep, 2));
+    burn_in_avg += autocorrelation.at(rep, 3);
+  }
+  burn_in_avg /= reps;
+  std::vector<double> values = { reps * (M - burn_in_avg) / ess_tot,
+                                 ess_tot,
+                                 ess_min,
+                                 burn_in_avg };
+  return values;
+};
+
 void
 MCMCStats::computeSampleStats(void)
 {
+  accumulateSampleCounts(0, reps);
+  finalizeSampleStats(reps);
+};
+
+/*
+ * Count the states and pairs of states in replicates 'first' to 'last' - 1.
+ * Until finalizeSampleStats() is called, frequency_1p and frequency_2p hold
+ * the counts summed over replicates, and the sigma members the sums of
+ * squared counts. Counts from several sets of replicates (e.g. sampled by
+ * different processes) can be added together before finalizing.
+ */
+void
+MCMCStats::accumulateSampleCounts(int first, int last)
+{
+  // The samples may have been resized since updateData() (e.g. on MPI worker
+  // processes, which do not call it).
+  M = samples->n_rows;
+
   frequency_1p = arma::Mat<double>(Q, N, arma::fill::zeros);
   frequency_1p_sigma = arma::Mat<double>(Q, N, arma::fill::zeros);
-  frequency_2p = arma::field<arma::Mat<double>>(N, N);
-  frequency_2p_sigma = arma::field<arma::Mat<double>>(N, N);
-  for (int i = 0; i < N; i++) {
-    for (int j = 0; j < N; j++) {
-      frequency_2p.at(i, j) = arma::Mat<double>(Q, Q, arma::fill::zeros);
-      frequency_2p_sigma.at(i, j) = arma::Mat<double>(Q, Q, arma::fill::zeros);
-    }
+  frequency_2p = PairTensor(alphabet_sizes);
+  if (lazy_sigma) {
+    frequency_2p_sigma = PairTensor();
+  } else {
+    frequency_2p_sigma = PairTensor(alphabet_sizes);
   }
 
   {
-    arma::Mat<double> n1 = arma::Mat<double>(Q, reps, arma::fill::zeros);
-    arma::Col<double> n1squared = arma::Col<double>(Q, arma::fill::zeros);
-    arma::Col<double> n1av = arma::Col<double>(Q, arma::fill::zeros);
-
+    arma::Col<double> n1 = arma::Col<double>(Q);
     for (int i = 0; i < N; i++) {
-      n1.zeros();
-      n1av.zeros();
-      n1squared.zeros();
-      for (int rep = 0; rep < reps; rep++) {
+      for (int rep = first; rep < last; rep++) {
+        n1.zeros();
         for (int m = 0; m < M; m++) {
-          n1.at(samples->at(m, i, rep), rep)++;
+          n1.at(samples->at(m, i, rep))++;
+        }
+        for (int aa = 0; aa < alphabet_sizes.at(i); aa++) {
+          frequency_1p.at(aa, i) += n1.at(aa);
+          frequency_1p_sigma.at(aa, i) += pow(n1.at(aa), 2);
         }
       }
-      for (int aa = 0; aa < Q; aa++) {
-        for (int rep = 0; rep < reps; rep++) {
-          n1av.at(aa) += n1.at(aa, rep);
-          n1squared.at(aa) += pow(n1.at(aa, rep), 2);
+    }
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      arma::Mat<double> n2 = arma::Mat<double>(
+        alphabet_sizes.at(i), alphabet_sizes.at(j), arma::fill::zeros);
+      arma::Mat<double>& count = frequency_2p.at(i, j);
+      for (int rep = first; rep < last; rep++) {
+        n2.zeros();
+        for (int m = 0; m < M; m++) {
+          n2.at(samples->at(m, i, rep), samples->at(m, j, rep))++;
+        }
+        count += n2;
+        if (!lazy_sigma) {
+          frequency_2p_sigma.at(i, j) += n2 % n2;
         }
-        frequency_1p.at(aa, i) = n1av.at(aa) / M / reps;
-        frequency_1p_sigma.at(aa, i) =
-          Max(sqrt((n1squared.at(aa) / (M * M * reps) -
-                    pow(n1av.at(aa) / (M * reps), 2)) /
-                   sqrt(reps)),
-              0);
       }
     }
   }
+};
 
-  {
-    arma::Cube<double> n2 = arma::Cube<double>(reps, Q, Q, arma::fill::zeros);
-    arma::Mat<double> n2av = arma::Mat<double>(Q, Q, arma::fill::zeros);
-    arma::Mat<double> n2squared = arma::Mat<double>(Q, Q, arma::fill::zeros);
+/*
+ * Turn the counts summed over 'total_reps' replicates into frequencies and
+ * their standard deviations over replicates.
+ */
+void
+MCMCStats::finalizeSampleStats(int total_reps)
+{
+  for (int i = 0; i < N; i++) {
+    for (int aa = 0; aa < alphabet_sizes.at(i); aa++) {
+      double n1av = frequency_1p.at(aa, i);
+      double n1squared = frequency_1p_sigma.at(aa, i);
+      frequency_1p.at(aa, i) = n1av / M / total_reps;
+      frequency_1p_sigma.at(aa, i) =
+        Max(sqrt((n1squared / (M * M * total_reps) -
+                  pow(n1av / (M * total_reps), 2)) /
+                 sqrt(total_reps)),
+            0);
+    }
+  }
 
-    for (int i = 0; i < N; i++) {
-      for (int j = i + 1; j < N; j++) {
-        n2.zeros();
-        n2av.zeros();
-        n2squared.zeros();
-        for (int rep = 0; rep < reps; rep++)
-          for (int m = 0; m < M; m++) {
-            n2.at(rep, samples->at(m, i, rep), samples->at(m, j, rep))++;
-          }
+  double* freq = frequency_2p.memptr();
+  double* sigma = frequency_2p_sigma.memptr();
+#pragma omp parallel for
+  for (long int k = 0; k < frequency_2p.n_elem; k++) {
+    double n2av = freq[k] / (M * total_reps);
+    freq[k] = n2av;
+    if (!lazy_sigma) {
+      double n2squared = sigma[k] / (M * total_reps);
+      sigma[k] = pow((n2squared / M - pow(n2av, 2)) / sqrt(total_reps), .5);
+    }
+  }
+};
 
-        n2av = arma::sum(n2, 0) / (M * reps);
-        n2squared = arma::sum(arma::pow(n2, 2), 0) / (M * reps);
-        frequency_2p.at(i, j) = n2av;
-        frequency_2p_sigma.at(i, j) =
-          arma::pow((n2squared / M - arma::pow(n2av, 2)) / sqrt(reps), .5);
-      }
+/*
+ * Compute the standard deviation of the 2p frequencies over replicates, as in
+ * computeSampleStats(). Used to write the sigmas when 'lazy_sigma' is set.
+ */
+PairTensor
+MCMCStats::computeFrequency2pSigma(void)
+{
+  PairTensor sigma = PairTensor(alphabet_sizes);
+  arma::Cube<double> n2;
+  arma::Mat<double> n2av;
+  arma::Mat<double> n2squared;
+
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      n2 = arma::Cube<double>(
+        reps, alphabet_sizes.at(i), alphabet_sizes.at(j), arma::fill::zeros);
+      for (int rep = 0; rep < reps; rep++)
+        for (int m = 0; m < M; m++) {
+          n2.at(rep, samples->at(m, i, rep), samples->at(m, j, rep))++;
+        }
+
+      n2av = arma::sum(n2, 0) / (M * reps);
+      n2squared = arma::sum(arma::pow(n2, 2), 0) / (M * reps);
+      sigma.at(i, j) =
+        arma::pow((n2squared / M - arma::pow(n2av, 2)) / sqrt(reps), .5);
     }
   }
+  return sigma;
 };
 
 void
@@ -345,18 +569,15 @@ MCMCStats::computeSampleStatsImportance(potts_model* cur, potts_model* prev)
 
   arma::Mat<int> n1 = arma::Mat<int>(Q, reps, arma::fill::zeros);
   arma::field<arma::Mat<int>> n2 = arma::field<arma::Mat<int>>(reps);
-  for (int rep = 0; rep < reps; rep++) {
-    n2.at(rep) = arma::Mat<int>(Q, Q, arma::fill::zeros);
-  }
 
   Z_ratio = Z_tot / Z_inv_tot;
   sumw_inv = 1.0 / sumw;
 
   arma::Col<int> n1av = arma::Col<int>(Q, arma::fill::zeros);
-  arma::Mat<int> n2av = arma::Mat<int>(Q, Q, arma::fill::zeros);
+  arma::Mat<int> n2av;
 
   arma::Col<int> n1squared = arma::Col<int>(Q, arma::fill::zeros);
-  arma::Mat<int> n2squared = arma::Mat<int>(Q, Q, arma::fill::zeros);
+  arma::Mat<int> n2squared;
 
   for (int i = 0; i < N; i++) {
     n1.zeros();
@@ -367,7 +588,7 @@ MCMCStats::computeSampleStatsImportance(potts_model* cur, potts_model* prev)
         n1.at(samples->at(m, i, rep), rep) += p.at(rep, m);
       }
     }
-    for (int aa = 0; aa < Q; aa++) {
+    for (int aa = 0; aa < alphabet_sizes.at(i); aa++) {
       for (int rep = 0; rep < reps; rep++) {
         n1av.at(aa) += w.at(rep) * n1.at(aa, rep);
         n1squared.at(aa) += w.at(rep) * pow(n1.at(aa, rep), 2);
@@ -382,30 +603,34 @@ MCMCStats::computeSampleStatsImportance(potts_model* cur, potts_model* prev)
 
   for (int i = 0; i < N; i++) {
     for (int j = i + 1; j < N; j++) {
+      int Q_i = alphabet_sizes.at(i);
+      int Q_j = alphabet_sizes.at(j);
       for (int rep = 0; rep < reps; rep++) {
-        n2.at(rep).zeros();
+        n2.at(rep) = arma::Mat<int>(Q_i, Q_j, arma::fill::zeros);
       }
-      n2av.zeros();
-      n2squared.zeros();
+      n2av = arma::Mat<int>(Q_i, Q_j, arma::fill::zeros);
+      n2squared = arma::Mat<int>(Q_i, Q_j, arma::fill::zeros);
       for (int rep = 0; rep < reps; rep++)
         for (int m = 0; m < M; m++) {
           n2.at(rep).at(samples->at(m, i, rep), samples->at(m, j, rep)) +=
             p.at(rep, m);
         }
 
-      for (int aa1 = 0; aa1 < Q; aa1++) {
-        for (int aa2 = 0; aa2 < Q; aa2++) {
+      for (int aa1 = 0; aa1 < Q_i; aa1++) {
+        for (int aa2 = 0; aa2 < Q_j; aa2++) {
           for (int rep = 0; rep < reps; rep++) {
             n2av.at(aa1, aa2) += w.at(rep) * n2.at(rep).at(aa1, aa2);
             n2squared.at(aa1, aa2) +=
               w.at(rep) * pow(n2.at(rep).at(aa1, aa2), 2);
           }
           frequency_2p.at(i, j).at(aa1, aa2) = (double)n2av.at(aa1, aa2);
-          frequency_2p_sigma.at(i, j).at(aa1, aa2) =
-            Max(sqrt(((double)n2squared.at(aa1, aa2) -
-                      pow((double)n2av.at(aa1, aa2), 2)) *
-                     sqrt(sumw)),
-                0);
+          if (!lazy_sigma) {
+            frequency_2p_sigma.at(i, j).at(aa1, aa2) =
+              Max(sqrt(((double)n2squared.at(aa1, aa2) -
+                        pow((double)n2av.at(aa1, aa2), 2)) *
+                       sqrt(sumw)),
+                  0);
+          }
         }
       }
     }
@@ -416,8 +641,15 @@ void
 MCMCStats::writeFrequency1p(std::string output_file,
                             std::string output_file_sigma)
 {
-  frequency_1p.save(output_file, arma::arma_binary);
-  frequency_1p_sigma.save(output_file_sigma, arma::arma_binary);
+  if (alphabet_map.is_empty()) {
+    frequency_1p.save(output_file, arma::arma_binary);
+    frequency_1p_sigma.save(output_file_sigma, arma::arma_binary);
+  } else {
+    expandAlphabet1p(frequency_1p, alphabet_map, true)
+      .save(output_file, arma::arma_binary);
+    expandAlphabet1p(frequency_1p_sigma, alphabet_map, true)
+      .save(output_file_sigma, arma::arma_binary);
+  }
 };
 
 void
@@ -427,12 +659,23 @@ MCMCStats::writeFrequency1pCompat(std::string output_file,
   std::ofstream output_stream(output_file);
   std::ofstream output_stream_sigma(output_file_sigma);
 
+  const arma::Mat<double>* freq = &frequency_1p;
+  const arma::Mat<double>* freq_sigma = &frequency_1p_sigma;
+  arma::Mat<double> expanded;
+  arma::Mat<double> expanded_sigma;
+  if (!alphabet_map.is_empty()) {
+    expanded = expandAlphabet1p(frequency_1p, alphabet_map, true);
+    expanded_sigma = expandAlphabet1p(frequency_1p_sigma, alphabet_map, true);
+    freq = &expanded;
+    freq_sigma = &expanded_sigma;
+  }
+
   for (int i = 0; i < N; i++) {
     output_stream << i;
     output_stream_sigma << i;
     for (int aa = 0; aa < Q; aa++) {
-      output_stream << " " << frequency_1p.at(aa, i);
-      output_stream_sigma << " " << frequency_1p_sigma.at(aa, i);
+      output_stream << " " << freq->at(aa, i);
+      output_stream_sigma << " " << freq_sigma->at(aa, i);
     }
     output_stream << std::endl;
     output_stream_sigma << std::endl;
@@ -443,8 +686,20 @@ void
 MCMCStats::writeFrequency2p(std::string output_file,
                             std::string output_file_sigma)
 {
-  frequency_2p.save(output_file, arma::arma_binary);
-  frequency_2p_sigma.save(output_file_sigma, arma::arma_binary);
+  const PairTensor* freq_sigma = &frequency_2p_sigma;
+  PairTensor lazy;
+  if (lazy_sigma) {
+    lazy = computeFrequency2pSigma();
+    freq_sigma = &lazy;
+  }
+
+  if (alphabet_map.is_empty()) {
+    frequency_2p.save(output_file);
+    freq_sigma->save(output_file_sigma);
+  } else {
+    expandAlphabet2p(frequency_2p, alphabet_map, true).save(output_file);
+    expandAlphabet2p(*freq_sigma, alphabet_map, true).save(output_file_sigma);
+  }
 };
 
 void
@@ -454,15 +709,30 @@ MCMCStats::writeFrequency2pCompat(std::string output_file,
   std::ofstream output_stream(output_file);
   std::ofstream output_stream_sigma(output_file_sigma);
 
+  const PairTensor* freq = &frequency_2p;
+  const PairTensor* freq_sigma = &frequency_2p_sigma;
+  PairTensor lazy;
+  PairTensor expanded;
+  PairTensor expanded_sigma;
+  if (lazy_sigma) {
+    lazy = computeFrequency2pSigma();
+    freq_sigma = &lazy;
+  }
+  if (!alphabet_map.is_empty()) {
+    expanded = expandAlphabet2p(frequency_2p, alphabet_map, true);
+    expanded_sigma = expandAlphabet2p(*freq_sigma, alphabet_map, true);
+    freq = &expanded;
+    freq_sigma = &expanded_sigma;
+  }
+
   for (int i = 0; i < N; i++) {
     for (int j = i + 1; j < N; j++) {
       output_stream << i << " " << j;
       output_stream_sigma << i << " " << j;
       for (int aa1 = 0; aa1 < Q; aa1++) {
         for (int aa2 = 0; aa2 < Q; aa2++) {
-          output_stream << " " << frequency_2p.at(i, j).at(aa1, aa2);
-          output_stream_sigma << " "
-                              << frequency_2p_sigma.at(i, j).at(aa1, aa2);
+          output_stream << " " << freq->at(i, j).at(aa1, aa2);
+          output_stream_sigma << " " << freq_sigma->at(i, j).at(aa1, aa2);
         }
       }
       output_stream << std::endl;
@@ -471,18 +741,38 @@ MCMCStats::writeFrequency2pCompat(std::string output_file,
   }
 };
 
+/*
+ * Write the samples as numerical sequences. With a compressed alphabet, a
+ * lumped state is written as its lowest-numbered amino acid.
+ */
 void
 MCMCStats::writeSamples(std::string output_file)
 {
   std::ofstream output_stream(output_file);
 
+  arma::Mat<int> states;
+  if (!alphabet_map.is_empty()) {
+    states = arma::Mat<int>(Q, N);
+    for (int i = 0; i < N; i++) {
+      for (int aa = Q - 1; aa >= 0; aa--) {
+        states.at(alphabet_map.at(aa, i), i) = aa;
+      }
+    }
+  }
+
   output_stream << reps * M << " " << N << " " << AA_ALPHABET_SIZE << std::endl;
 
   for (int rep = 0; rep < reps; rep++) {
     for (int m = 0; m < M; m++) {
-      output_stream << samples->at(m, 0, rep);
-      for (int i = 1; i < N; i++) {
-        output_stream << " " << samples->at(m, i, rep);
+      for (int i = 0; i < N; i++) {
+        int state = samples->at(m, i, rep);
+        if (!alphabet_map.is_empty()) {
+          state = states.at(state, i);
+        }
+        if (i > 0) {
+          output_stream << " ";
+        }
+        output_stream << state;
       }
       output_stream << std::endl;
     }
@@ -5,23 +5,33 @@
 
 #include "utils.hpp"
 
+// Integrated autocorrelation times (in units of the sampling time) above which
+// the sampling time is extended, and below which it is probed downward.
+#define IAT_INCREASE 1.5
+#define IAT_DECREASE 1.1
+
 class MCMCStats
 {
 public:
   MCMCStats(arma::Cube<int>*, potts_model*);
-  void updateData(arma::Cube<int>*, potts_model*);
+  void updateData(arma::Cube<int>*, potts_model*, bool = true);
 
   void computeEnergies(void);
   void computeEnergiesStats(void);
   void computeCorrelations(void);
+  void computeAutocorrelationTimes(void);
   void computeSampleStats(void);
+  void accumulateSampleCounts(int, int);
+  void finalizeSampleStats(int);
   void computeSampleStatsImportance(potts_model*, potts_model*);
 
   std::vector<double> getEnergiesStats(void);
   std::vector<double> getCorrelationsStats(void);
+  std::vector<double> getAutocorrelationStats(void);
 
   void writeEnergyStats(std::string, std::string, std::string, std::string);
   void writeCorrelationsStats(std::string, std::string, std::string);
+  void writeAutocorrelationStats(std::string);
   void writeFrequency1p(std::string, std::string);
   void writeFrequency2p(std::string, std::string);
   void writeFrequency1pCompat(std::string, std::string);
@@ -33,14 +43,20 @@ public:
 
   arma::Mat<double> frequency_1p;
   arma::Mat<double> frequency_1p_sigma;
-  arma::field<arma::Mat<double>> frequency_2p;
-  arma::field<arma::Mat<double>> frequency_2p_sigma;
+  PairTensor frequency_2p;
+  PairTensor frequency_2p_sigma;
+
+  arma::Mat<int> alphabet_map; // set to expand compressed alphabets on write
+  bool lazy_sigma;             // set to compute frequency_2p_sigma only when
+                               // it is written
 
   double Z_ratio;
   double sumw_inv;
   double dE_av_tot;
 
 private:
+  PairTensor computeFrequency2pSigma(void);
+
   potts_model* params;
   arma::Cube<int>* samples;
   arma::Mat<double> energies;
@@ -68,10 +84,15 @@ private:
   double err_cross_check;
   double err_check_auto;
 
+  arma::Mat<double> autocorrelation; // energy and overlap autocorrelation
+                                     // times, effective sample size and
+                                     // burn-in samples of each replicate
+
   int reps;
   int N;
   int Q;
   int M;
+  arma::Col<int> alphabet_sizes;
 };
 
 #endif
@@ -4,108 +4,392 @@
 
 #include "utils.hpp"
 
-Model::Model(MSAStats msa_stats, double epsilon_h, double epsilon_J)
+Model::Model(const MSAStats& msa_stats,
+             double epsilon_h,
+             double epsilon_J,
+             bool lean)
+  : lean(lean)
 {
   N = msa_stats.getN();
   Q = msa_stats.getQ();
+  alphabet_sizes = msa_stats.alphabet_sizes;
+  alphabet_map = msa_stats.alphabet_map;
   double pseudocount = 1. / msa_stats.getEffectiveM();
 
-  // Initialize the parameters J and h
-  params.J = arma::field<arma::Mat<double>>(N, N);
-  for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      params.J.at(i, j) = arma::Mat<double>(Q, Q, arma::fill::zeros);
-    }
-  }
+  // Initialize the parameters J and h. Each coupling block is Q_i x Q_j, and
+  // the fields are padded with zeros to Q states.
+  params.J = PairTensor(alphabet_sizes);
 
   params.h = arma::Mat<double>(Q, N, arma::fill::zeros);
   double avg;
-  double* freq_ptr = nullptr;
+  const double* freq_ptr = nullptr;
   for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
     avg = 0;
     freq_ptr = msa_stats.frequency_1p.colptr(i);
-    for (int aa = 0; aa < Q; aa++) {
+    for (int aa = 0; aa < Q_i; aa++) {
       avg +=
-        log((1. - pseudocount) * (*(freq_ptr + aa)) + pseudocount * (1. / Q));
+        log((1. - pseudocount) * (*(freq_ptr + aa)) + pseudocount * (1. / Q_i));
     }
-    for (int aa = 0; aa < Q; aa++) {
-      params.h.at(aa, i) =
-        log((1. - pseudocount) * (*(freq_ptr + aa)) + pseudocount * (1. / Q)) -
-        avg / Q;
+    for (int aa = 0; aa < Q_i; aa++) {
+      params.h.at(aa, i) = log((1. - pseudocount) * (*(freq_ptr + aa)) +
+                               pseudocount * (1. / Q_i)) -
+                           avg / Q_i;
     }
   }
 
   // Initialize the learning rates (epsilon_0_h and epsilon_0_H)
   learning_rates.h = arma::Mat<double>(Q, N);
   learning_rates.h.fill(epsilon_h);
-  learning_rates.J = arma::field<arma::Mat<double>>(N, N);
+  if (lean) {
+    lean_learning_rates_J =
+      std::vector<float>(params.J.n_elem, (float)epsilon_J);
+  } else {
+    learning_rates.J = PairTensor(alphabet_sizes);
+    learning_rates.J.fill(epsilon_J);
+  }
+
+  // Initialize the gradient
+  if (lean) {
+    lean_gradient_sign_J = std::vector<signed char>(params.J.n_elem, 0);
+  } else {
+    gradient.J = PairTensor(alphabet_sizes);
+  }
+  gradient.h = arma::Mat<double>(Q, N, arma::fill::zeros);
+};
+
+/*
+ * Replace the parameters by the mean-field estimate. The couplings are minus
+ * the inverse of the connected correlation matrix of the MSA, over all states
+ * but the last of each position, with the frequencies mixed with a fraction
+ * 'pseudocount' of uniform ones so that the matrix can be inverted. The fields
+ * follow from the mean-field equations. Parameters are then put in the
+ * zero-sum gauge, like those of the independent-site initialization.
+ */
+void
+Model::initializeMeanField(const MSAStats& msa_stats, double pseudocount)
+{
+  // Offset of each position in the correlation matrix. The last state of each
+  // position is the reference state, for which couplings are zero.
+  std::vector<int> offsets(N + 1, 0);
+  for (int i = 0; i < N; i++) {
+    offsets[i + 1] = offsets[i] + alphabet_sizes.at(i) - 1;
+  }
+  int D = offsets[N];
+
+  arma::Mat<double> freq_1p(Q, N, arma::fill::zeros);
   for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
+    for (int a = 0; a < Q_i; a++) {
+      freq_1p.at(a, i) = (1. - pseudocount) * msa_stats.frequency_1p.at(a, i) +
+                         pseudocount / Q_i;
+    }
+  }
+
+  arma::Mat<double> correlations(D, D, arma::fill::zeros);
+  for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
+    for (int a = 0; a < Q_i - 1; a++) {
+      for (int b = 0; b < Q_i - 1; b++) {
+        correlations.at(offsets[i] + a, offsets[i] + b) =
+          -freq_1p.at(a, i) * freq_1p.at(b, i);
+      }
+      correlations.at(offsets[i] + a, offsets[i] + a) += freq_1p.at(a, i);
+    }
     for (int j = i + 1; j < N; j++) {
-      learning_rates.J.at(i, j) = arma::Mat<double>(Q, Q);
-      learning_rates.J.at(i, j).fill(epsilon_J);
+      int Q_j = alphabet_sizes.at(j);
+      const arma::Mat<double>& freq_2p = msa_stats.frequency_2p.at(i, j);
+      for (int b = 0; b < Q_j - 1; b++) {
+        for (int a = 0; a < Q_i - 1; a++) {
+          double c = (1. - pseudocount) * freq_2p.at(a, b) +
+                     pseudocount / (Q_i * Q_j) -
+                     freq_1p.at(a, i) * freq_1p.at(b, j);
+          correlations.at(offsets[i] + a, offsets[j] + b) = c;
+          correlations.at(offsets[j] + b, offsets[i] + a) = c;
+        }
+      }
+    }
+  }
+
+  arma::Mat<double> inverse;
+  if (!arma::inv_sympd(inverse, correlations)) {
+    std::cerr << "ERROR: the correlation matrix could not be inverted; try a "
+                 "larger 'mf_pseudocount'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  correlations.reset();
+
+  // Fields of independent sites, relative to the reference state.
+  params.h.zeros();
+  for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
+    for (int a = 0; a < Q_i - 1; a++) {
+      params.h.at(a, i) = log(freq_1p.at(a, i) / freq_1p.at(Q_i - 1, i));
     }
   }
 
-  // Initialize the gradient
-  gradient.J = arma::field<arma::Mat<double>>(N, N);
   for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
     for (int j = i + 1; j < N; j++) {
-      gradient.J.at(i, j) = arma::Mat<double>(Q, Q, arma::fill::zeros);
+      int Q_j = alphabet_sizes.at(j);
+      arma::Mat<double>& J = params.J.at(i, j);
+      J.zeros();
+      for (int b = 0; b < Q_j - 1; b++) {
+        for (int a = 0; a < Q_i - 1; a++) {
+          J.at(a, b) = -inverse.at(offsets[i] + a, offsets[j] + b);
+          params.h.at(a, i) -= J.at(a, b) * freq_1p.at(b, j);
+          params.h.at(b, j) -= J.at(a, b) * freq_1p.at(a, i);
+        }
+      }
+
+      // Move the block to the zero-sum gauge, and its row and column means to
+      // the fields.
+      arma::Col<double> row_means = arma::mean(J, 1);
+      arma::Row<double> col_means = arma::mean(J, 0);
+      double mean = arma::mean(row_means);
+      for (int a = 0; a < Q_i; a++) {
+        params.h.at(a, i) += row_means.at(a) - mean;
+      }
+      for (int b = 0; b < Q_j; b++) {
+        params.h.at(b, j) += col_means.at(b) - mean;
+        for (int a = 0; a < Q_i; a++) {
+          J.at(a, b) += mean - row_means.at(a) - col_means.at(b);
+        }
+      }
     }
   }
-  gradient.h = arma::Mat<double>(Q, N, arma::fill::zeros);
-};
 
-void
-Model::writeParams(std::string output_file_h, std::string output_file_J)
-{
-  params.h.save(output_file_h, arma::arma_binary);
-  params.J.save(output_file_J, arma::arma_binary);
+  for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
+    double avg = 0;
+    for (int a = 0; a < Q_i; a++) {
+      avg += params.h.at(a, i);
+    }
+    for (int a = 0; a < Q_i; a++) {
+      params.h.at(a, i) -= avg / Q_i;
+    }
+  }
 };
 
+/*
+ * Copy 'source', a model over the full alphabet (as written by bmdca), into
+ * 'target', which has the alphabet of this model. Position i takes the values
+ * of position positions[i] of the source, or is left unchanged if that is -1.
+ * For lumped states, the values of the lumped amino acids are averaged, except
+ * that the fields of parameters are the log of their summed Boltzmann weights,
+ * which undoes the field correction of expandPottsModel().
+ */
 void
-Model::writeParamsCompat(std::string output_file)
+Model::importModel(const potts_model& source,
+                   const std::vector<int>& positions,
+                   bool is_params,
+                   potts_model* target)
 {
-  std::ofstream output_stream(output_file);
+  int Q_source = alphabet_map.is_empty() ? Q : alphabet_map.n_rows;
+  int N_source = source.h.n_cols;
+  if ((int)source.h.n_rows != Q_source) {
+    std::cerr << "ERROR: the initial model has " << source.h.n_rows
+              << " states per position instead of " << Q_source << "."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < N; i++) {
+    if (positions[i] >= N_source) {
+      std::cerr << "ERROR: position " << positions[i]
+                << " is not in the initial model, which has " << N_source
+                << " positions." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
 
-  int N = params.h.n_cols;
-  int Q = params.h.n_rows;
+  auto state = [this](int aa, int i) {
+    return alphabet_map.is_empty() ? aa : alphabet_map.at(aa, i);
+  };
+
+  for (int i = 0; i < N; i++) {
+    int k = positions[i];
+    if (k < 0) {
+      continue;
+    }
+    arma::Col<double> sums(Q, arma::fill::zeros);
+    arma::Col<double> counts(Q, arma::fill::zeros);
+    double max = source.h.col(k).max();
+    for (int aa = 0; aa < Q_source; aa++) {
+      if (is_params) {
+        sums.at(state(aa, i)) += exp(source.h.at(aa, k) - max);
+      } else {
+        sums.at(state(aa, i)) += source.h.at(aa, k);
+      }
+      counts.at(state(aa, i)) += 1;
+    }
+    for (int s = 0; s < alphabet_sizes.at(i); s++) {
+      if (alphabet_map.is_empty()) {
+        target->h.at(s, i) = source.h.at(s, k);
+      } else if (is_params) {
+        target->h.at(s, i) = log(sums.at(s)) + max;
+      } else {
+        target->h.at(s, i) = sums.at(s) / counts.at(s);
+      }
+    }
+  }
 
-  // Write J
   for (int i = 0; i < N; i++) {
     for (int j = i + 1; j < N; j++) {
-      for (int aa1 = 0; aa1 < Q; aa1++) {
-        for (int aa2 = 0; aa2 < Q; aa2++) {
-          output_stream << "J " << i << " " << j << " " << aa1 << " " << aa2
-                        << " " << params.J.at(i, j)(aa1, aa2) << std::endl;
+      int k = positions[i];
+      int l = positions[j];
+      if ((k < 0) || (l < 0)) {
+        continue;
+      }
+      arma::Mat<double> block;
+      if (k < l) {
+        block = source.J.at(k, l);
+      } else {
+        block = source.J.at(l, k).t();
+      }
+      if (alphabet_map.is_empty()) {
+        target->J.at(i, j) = block;
+        continue;
+      }
+      arma::Mat<double>& J = target->J.at(i, j);
+      arma::Mat<double> counts(J.n_rows, J.n_cols, arma::fill::zeros);
+      J.zeros();
+      for (int b = 0; b < Q_source; b++) {
+        for (int a = 0; a < Q_source; a++) {
+          J.at(state(a, i), state(b, j)) += block.at(a, b);
+          counts.at(state(a, i), state(b, j)) += 1;
         }
       }
+      J /= counts;
     }
   }
+};
 
-  // Write h
-  for (int i = 0; i < N; i++) {
-    for (int aa = 0; aa < Q; aa++) {
-      output_stream << "h " << i << " " << aa << " " << params.h(aa, i)
-                    << std::endl;
+/*
+ * Replace the parameters by those of a model written by bmdca, to continue or
+ * transfer its training (see importModel()).
+ */
+void
+Model::importParams(const potts_model& source,
+                    const std::vector<int>& positions)
+{
+  importModel(source, positions, true, &params);
+};
+
+/*
+ * Replace the learning rates by those written with a model by bmdca.
+ */
+void
+Model::importLearningRates(const potts_model& source,
+                           const std::vector<int>& positions)
+{
+  if (lean) {
+    potts_model rates = unpackLearningRates();
+    importModel(source, positions, false, &rates);
+    learning_rates.h = rates.h;
+    const double* rates_ptr = rates.J.memptr();
+    for (long int k = 0; k < rates.J.n_elem; k++) {
+      lean_learning_rates_J[k] = (float)rates_ptr[k];
     }
+  } else {
+    importModel(source, positions, false, &learning_rates);
   }
 };
 
+/*
+ * Write the parameters, learning rates and gradient as raw arrays, in the
+ * layout of this model, for checkpoints. readState() reads them back into a
+ * model built for the same alignment and settings.
+ */
 void
-Model::writeLearningRates(std::string output_file_h, std::string output_file_J)
+Model::writeState(std::ostream& stream) const
 {
-  learning_rates.h.save(output_file_h, arma::arma_binary);
-  learning_rates.J.save(output_file_J, arma::arma_binary);
+  auto write = [&stream](const void* ptr, long int n_bytes) {
+    stream.write(reinterpret_cast<const char*>(ptr), n_bytes);
+  };
+  write(params.h.memptr(), params.h.n_elem * sizeof(double));
+  write(params.J.memptr(), params.J.n_elem * sizeof(double));
+  write(learning_rates.h.memptr(), learning_rates.h.n_elem * sizeof(double));
+  write(gradient.h.memptr(), gradient.h.n_elem * sizeof(double));
+  if (lean) {
+    write(lean_learning_rates_J.data(),
+          lean_learning_rates_J.size() * sizeof(float));
+    write(lean_gradient_sign_J.data(), lean_gradient_sign_J.size());
+  } else {
+    write(learning_rates.J.memptr(), learning_rates.J.n_elem * sizeof(double));
+    write(gradient.J.memptr(), gradient.J.n_elem * sizeof(double));
+  }
+};
+
+bool
+Model::readState(std::istream& stream)
+{
+  auto read = [&stream](void* ptr, long int n_bytes) {
+    stream.read(reinterpret_cast<char*>(ptr), n_bytes);
+  };
+  read(params.h.memptr(), params.h.n_elem * sizeof(double));
+  read(params.J.memptr(), params.J.n_elem * sizeof(double));
+  read(learning_rates.h.memptr(), learning_rates.h.n_elem * sizeof(double));
+  read(gradient.h.memptr(), gradient.h.n_elem * sizeof(double));
+  if (lean) {
+    read(lean_learning_rates_J.data(),
+         lean_learning_rates_J.size() * sizeof(float));
+    read(lean_gradient_sign_J.data(), lean_gradient_sign_J.size());
+  } else {
+    read(learning_rates.J.memptr(), learning_rates.J.n_elem * sizeof(double));
+    read(gradient.J.memptr(), gradient.J.n_elem * sizeof(double));
+  }
+  return (bool)stream;
+};
+
+/*
+ * Return the learning rates of a lean model in double precision, for writing.
+ */
+potts_model
+Model::unpackLearningRates(void)
+{
+  potts_model rates;
+  rates.h = learning_rates.h;
+  rates.J = PairTensor(alphabet_sizes);
+  double* rates_ptr = rates.J.memptr();
+  for (long int k = 0; k < rates.J.n_elem; k++) {
+    rates_ptr[k] = lean_learning_rates_J[k];
+  }
+  return rates;
+};
+
+/*
+ * Return a copy of 'model' over the full alphabet. Only parameters get the
+ * field correction for lumped states (see expandPottsModel()).
+ */
+potts_model
+Model::expand(const potts_model& model, bool is_params)
+{
+  if (is_params) {
+    return expandPottsModel(model, alphabet_map);
+  }
+  potts_model expanded;
+  expanded.h = expandAlphabet1p(model.h, alphabet_map);
+  expanded.J = expandAlphabet2p(model.J, alphabet_map);
+  return expanded;
 };
 
 void
-Model::writeLearningRatesCompat(std::string output_file)
+Model::writeModel(const potts_model& model,
+                  std::string output_file_h,
+                  std::string output_file_J)
+{
+  model.h.save(output_file_h, arma::arma_binary);
+  model.J.save(output_file_J);
+};
+
+void
+Model::writeModelCompat(const potts_model& model, std::string output_file)
 {
   std::ofstream output_stream(output_file);
 
-  int N = learning_rates.h.n_cols;
-  int Q = learning_rates.h.n_rows;
+  int N = model.h.n_cols;
+  int Q = model.h.n_rows;
 
   // Write J
   for (int i = 0; i < N; i++) {
@@ -113,8 +397,7 @@ Model::writeLearningRatesCompat(std::string output_file)
       for (int aa1 = 0; aa1 < Q; aa1++) {
         for (int aa2 = 0; aa2 < Q; aa2++) {
           output_stream << "J " << i << " " << j << " " << aa1 << " " << aa2
-                        << " " << learning_rates.J.at(i, j)(aa1, aa2)
-                        << std::endl;
+                        << " " << model.J.at(i, j)(aa1, aa2) << std::endl;
         }
       }
     }
@@ -123,44 +406,82 @@ Model::writeLearningRatesCompat(std::string output_file)
   // Write h
   for (int i = 0; i < N; i++) {
     for (int aa = 0; aa < Q; aa++) {
-      output_stream << "h " << i << " " << aa << " " << learning_rates.h(aa, i)
+      output_stream << "h " << i << " " << aa << " " << model.h(aa, i)
                     << std::endl;
     }
   }
 };
 
 void
-Model::writeGradient(std::string output_file_h, std::string output_file_J)
+Model::writeParams(std::string output_file_h, std::string output_file_J)
 {
-  gradient.h.save(output_file_h, arma::arma_binary);
-  gradient.J.save(output_file_J, arma::arma_binary);
+  if (alphabet_map.is_empty()) {
+    writeModel(params, output_file_h, output_file_J);
+  } else {
+    writeModel(expand(params, true), output_file_h, output_file_J);
+  }
 };
 
 void
-Model::writeGradientCompat(std::string output_file)
+Model::writeParamsCompat(std::string output_file)
 {
-  std::ofstream output_stream(output_file);
-
-  int N = gradient.h.n_cols;
-  int Q = gradient.h.n_rows;
+  if (alphabet_map.is_empty()) {
+    writeModelCompat(params, output_file);
+  } else {
+    writeModelCompat(expand(params, true), output_file);
+  }
+};
 
-  // Write J
-  for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      for (int aa1 = 0; aa1 < Q; aa1++) {
-        for (int aa2 = 0; aa2 < Q; aa2++) {
-          output_stream << "J " << i << " " << j << " " << aa1 << " " << aa2
-                        << " " << gradient.J.at(i, j)(aa1, aa2) << std::endl;
-        }
-      }
+void
+Model::writeLearningRates(std::string output_file_h, std::string output_file_J)
+{
+  if (lean) {
+    potts_model rates = unpackLearningRates();
+    if (alphabet_map.is_empty()) {
+      writeModel(rates, output_file_h, output_file_J);
+    } else {
+      writeModel(expand(rates), output_file_h, output_file_J);
     }
+  } else if (alphabet_map.is_empty()) {
+    writeModel(learning_rates, output_file_h, output_file_J);
+  } else {
+    writeModel(expand(learning_rates), output_file_h, output_file_J);
   }
+};
 
-  // Write h
-  for (int i = 0; i < N; i++) {
-    for (int aa = 0; aa < Q; aa++) {
-      output_stream << "h " << i << " " << aa << " " << gradient.h(aa, i)
-                    << std::endl;
+void
+Model::writeLearningRatesCompat(std::string output_file)
+{
+  if (lean) {
+    potts_model rates = unpackLearningRates();
+    if (alphabet_map.is_empty()) {
+      writeModelCompat(rates, output_file);
+    } else {
+      writeModelCompat(expand(rates), output_file);
     }
+  } else if (alphabet_map.is_empty()) {
+    writeModelCompat(learning_rates, output_file);
+  } else {
+    writeModelCompat(expand(learning_rates), output_file);
+  }
+};
+
+void
+Model::writeGradient(std::string output_file_h, std::string output_file_J)
+{
+  if (alphabet_map.is_empty()) {
+    writeModel(gradient, output_file_h, output_file_J);
+  } else {
+    writeModel(expand(gradient), output_file_h, output_file_J);
+  }
+};
+
+void
+Model::writeGradientCompat(std::string output_file)
+{
+  if (alphabet_map.is_empty()) {
+    writeModelCompat(gradient, output_file);
+  } else {
+    writeModelCompat(expand(gradient), output_file);
   }
 };
@@ -1,6 +1,9 @@
 #ifndef MODEL_HPP
 #define MODEL_HPP
 
+#include <iostream>
+#include <vector>
+
 #include "msa_stats.hpp"
 #include "utils.hpp"
 
@@ -12,8 +15,24 @@ public:
   potts_model gradient;
   int N;
   int Q;
+  arma::Col<int> alphabet_sizes; // number of states at each position
+  arma::Mat<int> alphabet_map;   // see MSAStats::compressAlphabet()
+
+  // In lean mode, gradient.J and learning_rates.J are left empty. Only the
+  // sign of the last coupling gradient is kept, and coupling learning rates
+  // are kept in single precision, both in the packed order of PairTensor.
+  bool lean;
+  std::vector<signed char> lean_gradient_sign_J;
+  std::vector<float> lean_learning_rates_J;
+
+  Model(const MSAStats&, double, double, bool = false);
 
-  Model(MSAStats, double, double);
+  void initializeMeanField(const MSAStats&, double);
+  void importParams(const potts_model&, const std::vector<int>&);
+  void importLearningRates(const potts_model&, const std::vector<int>&);
+
+  void writeState(std::ostream&) const;
+  bool readState(std::istream&);
 
   void writeParams(std::string, std::string);
   void writeLearningRates(std::string, std::string);
@@ -22,6 +41,16 @@ public:
   void writeParamsCompat(std::string);
   void writeLearningRatesCompat(std::string);
   void writeGradientCompat(std::string);
+
+private:
+  void importModel(const potts_model&,
+                   const std::vector<int>&,
+                   bool,
+                   potts_model*);
+  potts_model expand(const potts_model&, bool = false);
+  potts_model unpackLearningRates(void);
+  void writeModel(const potts_model&, std::string, std::string);
+  void writeModelCompat(const potts_model&, std::string);
 };
 
 #endif
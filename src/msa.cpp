@@ -2,11 +2,19 @@
 
 #include <armadillo>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
+#include "pcg_random.hpp"
+
 #ifndef AA_ALPHABET_SIZE
 #define AA_ALPHABET_SIZE 21
 #endif
@@ -17,7 +25,11 @@ MSA::MSA(std::string msa_file,
          double threshold)
 {
   if (is_numeric_msa) {
-    readInputNumericMSA(msa_file);
+    if (isBinaryMSA(msa_file)) {
+      readInputBinaryMSA(msa_file);
+    } else {
+      readInputNumericMSA(msa_file);
+    }
   } else {
     readInputMSA(msa_file);
     M = seq_records.size();
@@ -27,7 +39,9 @@ MSA::MSA(std::string msa_file,
   }
   if (reweight) {
     computeSequenceWeights(threshold);
-  } else {
+  } else if (sequence_weights.n_elem != (arma::uword)M) {
+    // Binary alignments carry their own weights, so only default to uniform
+    // weights if none were read.
     sequence_weights = arma::vec(M, arma::fill::ones);
   }
 };
@@ -35,7 +49,11 @@ MSA::MSA(std::string msa_file,
 MSA::MSA(std::string msa_file, std::string weights_file, bool is_numeric_msa)
 {
   if (is_numeric_msa) {
-    readInputNumericMSA(msa_file);
+    if (isBinaryMSA(msa_file)) {
+      readInputBinaryMSA(msa_file);
+    } else {
+      readInputNumericMSA(msa_file);
+    }
   } else {
     readInputMSA(msa_file);
     M = seq_records.size();
@@ -77,6 +95,113 @@ MSA::readInputNumericMSA(std::string numeric_msa_file)
   }
 }
 
+static uint64_t
+fnv1a(const unsigned char* data, size_t n, uint64_t hash = 14695981039346656037ULL)
+{
+  for (size_t i = 0; i < n; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+};
+
+bool
+isBinaryMSA(std::string msa_file)
+{
+  std::ifstream input_stream(msa_file, std::ios::binary);
+  char magic[8] = { 0 };
+  input_stream.read(magic, sizeof(magic));
+  if (!input_stream) {
+    return false;
+  }
+  return std::memcmp(magic, MSA_BINARY_MAGIC, sizeof(magic)) == 0;
+};
+
+const unsigned char*
+mapBinaryMSA(std::string binary_msa_file,
+             msa_binary_header* header,
+             size_t* map_size)
+{
+  int fd = open(binary_msa_file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    std::cerr << "ERROR: couldn't open '" << binary_msa_file
+              << "' for reading." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  size_t file_size = st.st_size;
+  if (file_size < sizeof(msa_binary_header)) {
+    std::cerr << "ERROR: '" << binary_msa_file << "' is truncated."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  void* map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "ERROR: couldn't map '" << binary_msa_file << "'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  madvise(map, file_size, MADV_SEQUENTIAL);
+
+  std::memcpy(header, map, sizeof(msa_binary_header));
+  size_t n_residues = (size_t)header->M * header->N;
+  size_t payload_size = 2 * n_residues + header->M * sizeof(double);
+  if (header->version != MSA_BINARY_VERSION ||
+      file_size != sizeof(msa_binary_header) + payload_size) {
+    std::cerr << "ERROR: '" << binary_msa_file
+              << "' is not a valid binary alignment." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  const unsigned char* payload =
+    (const unsigned char*)map + sizeof(msa_binary_header);
+  if (fnv1a(payload, payload_size) != header->checksum) {
+    std::cerr << "ERROR: checksum mismatch in '" << binary_msa_file << "'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  *map_size = file_size;
+  return (const unsigned char*)map;
+};
+
+void
+MSA::readInputBinaryMSA(std::string binary_msa_file)
+{
+  msa_binary_header header;
+  size_t map_size;
+  const unsigned char* map =
+    mapBinaryMSA(binary_msa_file, &header, &map_size);
+  M = header.M;
+  N = header.N;
+  Q = header.Q;
+
+  // The column-ordered block has the same layout as arma::Mat, so each column
+  // is a straight widening copy.
+  size_t n_residues = (size_t)M * N;
+  const unsigned char* col_block =
+    map + sizeof(msa_binary_header) + n_residues;
+  alignment = arma::Mat<int>(M, N);
+  for (int i = 0; i < N; i++) {
+    int* align_ptr = alignment.colptr(i);
+    const unsigned char* src_ptr = col_block + (size_t)i * M;
+    for (int m = 0; m < M; m++) {
+      *(align_ptr + m) = *(src_ptr + m);
+    }
+  }
+
+  sequence_weights = arma::Col<double>(M);
+  std::memcpy(sequence_weights.memptr(),
+              col_block + n_residues,
+              M * sizeof(double));
+
+  munmap((void*)map, map_size);
+};
+
 void
 MSA::readSequenceWeights(std::string weights_file)
 {
@@ -148,97 +273,10 @@ MSA::makeNumericalMatrix(void)
     std::string sequence = seq->getSequence();
     int col_idx = 0;
     for (auto aa = sequence.begin(); aa != sequence.end(); aa++) {
-      switch (*aa) {
-        case '-':
-        case 'B':
-        case 'J':
-        case 'O':
-        case 'U':
-        case 'X':
-        case 'Z':
-          alignment.at(row_idx, col_idx) = 0;
-          col_idx++;
-          break;
-        case 'A':
-          alignment.at(row_idx, col_idx) = 1;
-          col_idx++;
-          break;
-        case 'C':
-          alignment.at(row_idx, col_idx) = 2;
-          col_idx++;
-          break;
-        case 'D':
-          alignment.at(row_idx, col_idx) = 3;
-          col_idx++;
-          break;
-        case 'E':
-          alignment.at(row_idx, col_idx) = 4;
-          col_idx++;
-          break;
-        case 'F':
-          alignment.at(row_idx, col_idx) = 5;
-          col_idx++;
-          break;
-        case 'G':
-          alignment.at(row_idx, col_idx) = 6;
-          col_idx++;
-          break;
-        case 'H':
-          alignment.at(row_idx, col_idx) = 7;
-          col_idx++;
-          break;
-        case 'I':
-          alignment.at(row_idx, col_idx) = 8;
-          col_idx++;
-          break;
-        case 'K':
-          alignment.at(row_idx, col_idx) = 9;
-          col_idx++;
-          break;
-        case 'L':
-          alignment.at(row_idx, col_idx) = 10;
-          col_idx++;
-          break;
-        case 'M':
-          alignment.at(row_idx, col_idx) = 11;
-          col_idx++;
-          break;
-        case 'N':
-          alignment.at(row_idx, col_idx) = 12;
-          col_idx++;
-          break;
-        case 'P':
-          alignment.at(row_idx, col_idx) = 13;
-          col_idx++;
-          break;
-        case 'Q':
-          alignment.at(row_idx, col_idx) = 14;
-          col_idx++;
-          break;
-        case 'R':
-          alignment.at(row_idx, col_idx) = 15;
-          col_idx++;
-          break;
-        case 'S':
-          alignment.at(row_idx, col_idx) = 16;
-          col_idx++;
-          break;
-        case 'T':
-          alignment.at(row_idx, col_idx) = 17;
-          col_idx++;
-          break;
-        case 'V':
-          alignment.at(row_idx, col_idx) = 18;
-          col_idx++;
-          break;
-        case 'W':
-          alignment.at(row_idx, col_idx) = 19;
-          col_idx++;
-          break;
-        case 'Y':
-          alignment.at(row_idx, col_idx) = 20;
-          col_idx++;
-          break;
+      int aa_num = aaToNumeric(*aa);
+      if (aa_num >= 0) {
+        alignment.at(row_idx, col_idx) = aa_num;
+        col_idx++;
       }
     }
     row_idx++;
@@ -261,6 +299,41 @@ MSA::writeMatrix(std::string output_file)
   }
 };
 
+void
+MSA::writeMatrixBinary(std::string output_file)
+{
+  size_t n_residues = (size_t)M * N;
+  std::vector<unsigned char> row_block(n_residues);
+  std::vector<unsigned char> col_block(n_residues);
+  for (int i = 0; i < N; i++) {
+    int* align_ptr = alignment.colptr(i);
+    for (int m = 0; m < M; m++) {
+      row_block[(size_t)m * N + i] = *(align_ptr + m);
+      col_block[(size_t)i * M + m] = *(align_ptr + m);
+    }
+  }
+
+  msa_binary_header header;
+  std::memcpy(header.magic, MSA_BINARY_MAGIC, sizeof(header.magic));
+  header.version = MSA_BINARY_VERSION;
+  header.M = M;
+  header.N = N;
+  header.Q = Q;
+  header.checksum = fnv1a(row_block.data(), n_residues);
+  header.checksum = fnv1a(col_block.data(), n_residues, header.checksum);
+  header.checksum =
+    fnv1a((const unsigned char*)sequence_weights.memptr(),
+          M * sizeof(double),
+          header.checksum);
+
+  std::ofstream output_stream(output_file, std::ios::binary);
+  output_stream.write((const char*)&header, sizeof(header));
+  output_stream.write((const char*)row_block.data(), n_residues);
+  output_stream.write((const char*)col_block.data(), n_residues);
+  output_stream.write((const char*)sequence_weights.memptr(),
+                      M * sizeof(double));
+};
+
 void
 MSA::printAlignment(void)
 {
@@ -277,52 +350,208 @@ MSA::getSequenceLength(std::string sequence)
   int valid_aa_count = 0;
   for (std::string::iterator it = sequence.begin(); it != sequence.end();
        ++it) {
-    switch (*it) {
-      case '-':
-      case 'B':
-      case 'J':
-      case 'O':
-      case 'U':
-      case 'X':
-      case 'Z':
-      case 'A':
-      case 'C':
-      case 'D':
-      case 'E':
-      case 'F':
-      case 'G':
-      case 'H':
-      case 'I':
-      case 'K':
-      case 'L':
-      case 'M':
-      case 'N':
-      case 'P':
-      case 'Q':
-      case 'R':
-      case 'S':
-      case 'T':
-      case 'V':
-      case 'W':
-      case 'Y':
-        valid_aa_count += 1;
-        break;
+    if (aaToNumeric(*it) >= 0) {
+      valid_aa_count += 1;
     }
   }
   return valid_aa_count;
 };
 
+/*
+ * Drop the positions whose fraction of gaps is above 'gap_max'. The original
+ * index of each kept position is recorded in 'position_map'. Returns the
+ * number of positions that were removed.
+ */
+int
+MSA::filterPositions(double gap_max)
+{
+  if (position_map.n_elem != (arma::uword)N) {
+    position_map = arma::Col<int>(N);
+    for (int i = 0; i < N; i++) {
+      position_map.at(i) = i;
+    }
+  }
+
+  std::vector<int> kept_positions;
+  for (int i = 0; i < N; i++) {
+    int* align_ptr = alignment.colptr(i);
+    int gaps = 0;
+    for (int m = 0; m < M; m++) {
+      if (*(align_ptr + m) == 0) {
+        gaps++;
+      }
+    }
+    if (gaps <= gap_max * M) {
+      kept_positions.push_back(i);
+    }
+  }
+
+  int N_kept = kept_positions.size();
+  arma::Mat<int> kept_alignment = arma::Mat<int>(M, N_kept);
+  arma::Col<int> kept_position_map = arma::Col<int>(N_kept);
+  for (int i = 0; i < N_kept; i++) {
+    int* src_ptr = alignment.colptr(kept_positions[i]);
+    int* dest_ptr = kept_alignment.colptr(i);
+    for (int m = 0; m < M; m++) {
+      *(dest_ptr + m) = *(src_ptr + m);
+    }
+    kept_position_map.at(i) = position_map.at(kept_positions[i]);
+  }
+
+  alignment = kept_alignment;
+  position_map = kept_position_map;
+
+  int removed = N - N_kept;
+  N = N_kept;
+  return removed;
+};
+
+/*
+ * Drop the sequences whose fraction of gaps is above 'gap_max', along with
+ * their weights. Returns the number of sequences that were removed.
+ */
+int
+MSA::filterSequences(double gap_max)
+{
+  std::vector<int> kept_rows;
+  for (int m = 0; m < M; m++) {
+    int gaps = 0;
+    for (int i = 0; i < N; i++) {
+      if (alignment.at(m, i) == 0) {
+        gaps++;
+      }
+    }
+    if (gaps <= gap_max * N) {
+      kept_rows.push_back(m);
+    }
+  }
+
+  int M_kept = kept_rows.size();
+  arma::Mat<int> kept_alignment = arma::Mat<int>(M_kept, N);
+  for (int i = 0; i < N; i++) {
+    for (int m = 0; m < M_kept; m++) {
+      kept_alignment.at(m, i) = alignment.at(kept_rows[m], i);
+    }
+  }
+
+  arma::Col<double> kept_weights = arma::Col<double>(M_kept);
+  for (int m = 0; m < M_kept; m++) {
+    kept_weights.at(m) = sequence_weights.at(kept_rows[m]);
+  }
+
+  if (multiplicities.n_elem == (arma::uword)M) {
+    arma::Col<int> kept_multiplicities = arma::Col<int>(M_kept);
+    for (int m = 0; m < M_kept; m++) {
+      kept_multiplicities.at(m) = multiplicities.at(kept_rows[m]);
+    }
+    multiplicities = kept_multiplicities;
+  }
+
+  if (seq_records.size() == (size_t)M) {
+    std::vector<SeqRecord> kept_records;
+    for (auto m = kept_rows.begin(); m != kept_rows.end(); m++) {
+      kept_records.push_back(seq_records[*m]);
+    }
+    seq_records.swap(kept_records);
+  }
+
+  alignment = kept_alignment;
+  sequence_weights = kept_weights;
+
+  int removed = M - M_kept;
+  M = M_kept;
+  return removed;
+};
+
+/*
+ * Collapse identical sequences into a single row. The weight of each kept row
+ * is the sum of the weights of its copies, and the number of copies is stored
+ * in 'multiplicities' so that the weights can be recomputed later. Returns the
+ * number of rows that were removed.
+ */
+int
+MSA::collapseDuplicates(void)
+{
+  if (multiplicities.n_elem != (arma::uword)M) {
+    multiplicities = arma::Col<int>(M, arma::fill::ones);
+  }
+
+  std::unordered_map<std::string, int> unique_rows;
+  std::vector<int> row_map(M);
+  std::vector<int> kept_rows;
+  std::string key(N, 0);
+  for (int m = 0; m < M; m++) {
+    for (int i = 0; i < N; i++) {
+      key[i] = (char)alignment.at(m, i);
+    }
+    auto it = unique_rows.find(key);
+    if (it == unique_rows.end()) {
+      row_map[m] = kept_rows.size();
+      unique_rows.emplace(key, kept_rows.size());
+      kept_rows.push_back(m);
+    } else {
+      row_map[m] = it->second;
+    }
+  }
+
+  int M_unique = kept_rows.size();
+  arma::Col<double> unique_weights =
+    arma::Col<double>(M_unique, arma::fill::zeros);
+  arma::Col<int> unique_multiplicities =
+    arma::Col<int>(M_unique, arma::fill::zeros);
+  for (int m = 0; m < M; m++) {
+    unique_weights.at(row_map[m]) += sequence_weights.at(m);
+    unique_multiplicities.at(row_map[m]) += multiplicities.at(m);
+  }
+
+  if (seq_records.size() == (size_t)M) {
+    std::vector<SeqRecord> unique_records;
+    for (auto m = kept_rows.begin(); m != kept_rows.end(); m++) {
+      unique_records.push_back(seq_records[*m]);
+    }
+    seq_records.swap(unique_records);
+  }
+
+  arma::Mat<int> unique_alignment = arma::Mat<int>(M_unique, N);
+  for (int i = 0; i < N; i++) {
+    for (int m = 0; m < M_unique; m++) {
+      unique_alignment.at(m, i) = alignment.at(kept_rows[m], i);
+    }
+  }
+
+  alignment = unique_alignment;
+  sequence_weights = unique_weights;
+  multiplicities = unique_multiplicities;
+
+  int removed = M - M_unique;
+  M = M_unique;
+  return removed;
+};
+
+/*
+ * Weight each sequence by the inverse of the number of sequences that are at
+ * least 'threshold' identical to it (itself included). Collapsed rows count
+ * once per copy and are given the combined weight of their copies.
+ */
 void
 MSA::computeSequenceWeights(double threshold)
 {
+  bool collapsed = (multiplicities.n_elem == (arma::uword)M);
   sequence_weights = arma::vec(M, arma::fill::zeros);
   arma::Mat<int> alignment_T = alignment.t();
 
   double id;
   int* m1_ptr = nullptr;
   int* m2_ptr = nullptr;
+  int m1_count = 1;
+  int m2_count = 1;
   for (int m1 = 0; m1 < M; ++m1) {
-    sequence_weights.at(m1) += 1;
+    if (collapsed) {
+      m1_count = multiplicities.at(m1);
+    }
+    // Copies of a row only count as neighbours if identical sequences pass
+    // the threshold.
+    sequence_weights.at(m1) += (N > threshold * N) ? m1_count : 1;
     m1_ptr = alignment_T.colptr(m1);
     for (int m2 = m1 + 1; m2 < M; ++m2) {
       m2_ptr = alignment_T.colptr(m2);
@@ -333,14 +562,87 @@ MSA::computeSequenceWeights(double threshold)
         }
       }
       if (id > threshold * N) {
-        sequence_weights.at(m1) += 1;
-        sequence_weights.at(m2) += 1;
+        if (collapsed) {
+          m2_count = multiplicities.at(m2);
+        }
+        sequence_weights.at(m1) += m2_count;
+        sequence_weights.at(m2) += m1_count;
       }
     }
   }
 
   for (int m1 = 0; m1 < M; ++m1) {
-    sequence_weights.at(m1) = 1. / sequence_weights.at(m1);
+    if (collapsed) {
+      m1_count = multiplicities.at(m1);
+    }
+    sequence_weights.at(m1) = m1_count / sequence_weights.at(m1);
+  }
+};
+
+/*
+ * Draw sequences at random, with probabilities proportional to their weights,
+ * e.g. to start MCMC chains close to equilibrium. Sequences are drawn without
+ * replacement until all of them (with non-zero weight) have been drawn, and
+ * then again from the whole alignment. Returns one sequence per column.
+ */
+arma::Mat<int>
+MSA::sampleSequences(int count, long int seed) const
+{
+  pcg32 rng(seed);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  arma::Mat<int> sequences = arma::Mat<int>(N, count);
+  arma::Col<double> weights = sequence_weights;
+  int remaining = 0;
+  for (int m = 0; m < M; m++) {
+    if (sequence_weights.at(m) > 0) {
+      remaining++;
+    }
+  }
+  if (remaining == 0) {
+    std::cerr << "ERROR: cannot draw sequences with zero total weight."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  int drawable = remaining;
+  for (int c = 0; c < count; c++) {
+    if (remaining == 0) {
+      weights = sequence_weights;
+      remaining = drawable;
+    }
+    double u = uniform(rng) * arma::accu(weights);
+    int m = 0;
+    for (int k = 0; k < M; k++) {
+      if (weights.at(k) > 0) {
+        m = k;
+        if (u < weights.at(k)) {
+          break;
+        }
+        u -= weights.at(k);
+      }
+    }
+    for (int i = 0; i < N; i++) {
+      sequences.at(i, c) = alignment.at(m, i);
+    }
+    weights.at(m) = 0;
+    remaining--;
+  }
+  return sequences;
+};
+
+void
+MSA::writePositionMap(std::string output_file)
+{
+  if (position_map.n_elem != (arma::uword)N) {
+    position_map = arma::Col<int>(N);
+    for (int i = 0; i < N; i++) {
+      position_map.at(i) = i;
+    }
+  }
+
+  std::ofstream output_stream(output_file);
+  for (int i = 0; i < N; i++) {
+    output_stream << i << " " << position_map.at(i) << std::endl;
   }
 };
 
@@ -2,16 +2,45 @@
 #define MSA_HPP
 
 #include <armadillo>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 #include "utils.hpp"
 
+/*
+ * Binary numerical alignment format (e.g. 'msa_numerical.bin'). The header is
+ * followed by the alignment stored twice, once by rows (M x N, one sequence
+ * after another) and once by columns (N x M, matching the column-major layout
+ * of arma::Mat), and then by the M sequence weights (double). The checksum is
+ * a 64-bit FNV-1a hash of everything after the header.
+ */
+#define MSA_BINARY_MAGIC "BMDCAMSA"
+#define MSA_BINARY_VERSION 1
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t M;
+  uint32_t N;
+  uint32_t Q;
+  uint64_t checksum;
+} msa_binary_header;
+
+bool isBinaryMSA(std::string);
+
+// Map and validate a binary alignment. The returned pointer is the start of
+// the file, and the caller is responsible for calling munmap() on it.
+const unsigned char* mapBinaryMSA(std::string, msa_binary_header*, size_t*);
+
 class MSA
 {
 public:
   arma::Mat<int> alignment;           // numerical multiple sequence alignment
   arma::Col<double> sequence_weights; // weights for each sequence
+  arma::Col<int> multiplicities;      // copies of each collapsed sequence
+  arma::Col<int> position_map;        // original index of each position
   int M;                              // number of sequences
   int N;                              // number of positions
   int Q;                              // number of amino acids
@@ -20,16 +49,23 @@ public:
   MSA(std::string, std::string, bool = false);
   void printAlignment();
   void writeMatrix(std::string);
+  void writeMatrixBinary(std::string);
   void writeSequenceWeights(std::string);
+  void writePositionMap(std::string);
+  int filterPositions(double);
+  int filterSequences(double);
+  int collapseDuplicates(void);
+  void computeSequenceWeights(double);
+  arma::Mat<int> sampleSequences(int, long int) const;
 
 private:
   std::vector<SeqRecord> seq_records;
   int getSequenceLength(std::string);
   void readInputMSA(std::string);
   void readInputNumericMSA(std::string);
+  void readInputBinaryMSA(std::string);
   void readSequenceWeights(std::string);
   void makeNumericalMatrix(void);
-  void computeSequenceWeights(double);
 };
 
 #endif
@@ -4,22 +4,61 @@
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <utility>
 
 #ifndef AA_ALPHABET_SIZE
 #define AA_ALPHABET_SIZE 21
 #endif
 
-MSAStats::MSAStats(MSA msa)
+MSAStats::MSAStats(const MSA& msa)
 {
-  // Initialize
   N = msa.N;
   M = msa.M;
   Q = AA_ALPHABET_SIZE;
 
+  initializeFrequencies();
+  accumulateCounts(msa.alignment, msa.sequence_weights, M);
+  finalizeFrequencies();
+};
+
+/*
+ * Build the statistics from an alignment that is read from disk in chunks of
+ * sequences, so that only about 'memory_budget' bytes of the alignment are
+ * held in memory at a time. The sequence weights must be supplied with the
+ * alignment, as reweighting needs all sequences at once.
+ */
+MSAStats::MSAStats(MSAStream* msa_stream, long int memory_budget)
+{
+  N = msa_stream->N;
+  M = 0;
+  Q = AA_ALPHABET_SIZE;
+
+  long int chunk_size =
+    memory_budget / (N * sizeof(int) + sizeof(double));
+  if (chunk_size < 1) {
+    chunk_size = 1;
+  }
+  arma::Mat<int> chunk = arma::Mat<int>(chunk_size, N);
+  arma::Col<double> chunk_weights = arma::Col<double>(chunk_size);
+
+  initializeFrequencies();
+  int rows;
+  while ((rows = msa_stream->readChunk(&chunk, &chunk_weights)) > 0) {
+    accumulateCounts(chunk, chunk_weights, rows);
+    M += rows;
+  }
+  finalizeFrequencies();
+};
+
+void
+MSAStats::initializeFrequencies(void)
+{
   frequency_1p = arma::Mat<double>(AA_ALPHABET_SIZE, N, arma::fill::zeros);
-  frequency_2p = arma::field<arma::Mat<double>>(N, N);
+  frequency_2p = PairTensor(N, AA_ALPHABET_SIZE);
   rel_entropy_grad_1p =
     arma::Mat<double>(AA_ALPHABET_SIZE, N, arma::fill::zeros);
+  alphabet_sizes = arma::Col<int>(N);
+  alphabet_sizes.fill(AA_ALPHABET_SIZE);
   aa_background_frequencies =
     arma::Col<double>::fixed<AA_ALPHABET_SIZE>(arma::fill::zeros);
 
@@ -28,34 +67,55 @@ MSAStats::MSAStats(MSA msa)
     0.023, 0.043, 0.052, 0.040, 0.052, 0.073, 0.056, 0.063, 0.013, 0.033
   };
   pseudocount = 0.03;
+  M_effective = 0;
+};
+
+/*
+ * Add the weighted 1p and 2p counts of the first 'rows' sequences of
+ * 'alignment'. Counts are normalized in finalizeFrequencies().
+ */
+void
+MSAStats::accumulateCounts(const arma::Mat<int>& alignment,
+                           const arma::Col<double>& weights,
+                           int rows)
+{
+  const double* weight_ptr = weights.memptr();
+  for (int m = 0; m < rows; m++) {
+    M_effective += *(weight_ptr + m);
+  }
 
   // Compute the frequecies (1p statistics) for amino acids (and gaps) for each
   // position. Use pointers to make things speedier.
-  M_effective = sum(msa.sequence_weights);
-  int* align_ptr = nullptr;
+  const int* align_ptr = nullptr;
   double* freq_ptr = nullptr;
-  double* weight_ptr = msa.sequence_weights.memptr();
   for (int i = 0; i < N; i++) {
-    align_ptr = msa.alignment.colptr(i);
+    align_ptr = alignment.colptr(i);
     freq_ptr = frequency_1p.colptr(i);
-    for (int m = 0; m < M; m++) {
+    for (int m = 0; m < rows; m++) {
       *(freq_ptr + *(align_ptr + m)) += *(weight_ptr + m);
     }
   }
-  frequency_1p = frequency_1p / M_effective;
 
   // Compute the 2p statistics
+#pragma omp parallel for schedule(dynamic)
   for (int i = 0; i < N; i++) {
+    const int* align_ptr1 = alignment.colptr(i);
     for (int j = i + 1; j < N; j++) {
-      frequency_2p.at(i, j) = arma::Mat<double>(
-        AA_ALPHABET_SIZE, AA_ALPHABET_SIZE, arma::fill::zeros);
-
-      int* align_ptr1 = msa.alignment.colptr(i);
-      int* align_ptr2 = msa.alignment.colptr(j);
-      for (int m = 0; m < M; m++) {
-        frequency_2p.at(i, j)(*(align_ptr1 + m), *(align_ptr2 + m)) +=
-          *(weight_ptr + m);
+      const int* align_ptr2 = alignment.colptr(j);
+      arma::Mat<double>& freq = frequency_2p.at(i, j);
+      for (int m = 0; m < rows; m++) {
+        freq.at(*(align_ptr1 + m), *(align_ptr2 + m)) += *(weight_ptr + m);
       }
+    }
+  }
+};
+
+void
+MSAStats::finalizeFrequencies(void)
+{
+  frequency_1p = frequency_1p / M_effective;
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
       frequency_2p.at(i, j) = frequency_2p.at(i, j) / M_effective;
     }
   }
@@ -96,26 +156,109 @@ MSAStats::MSAStats(MSA msa)
   }
 };
 
+/*
+ * Compress the alphabet at each position to the amino acids whose frequency
+ * is above 'min_frequency', plus one state that lumps all others together.
+ * The kept states keep their order, and the lumped state comes last. The 1p
+ * and 2p frequencies are summed over the lumped amino acids, so that the
+ * coupling blocks become Q_i x Q_j. The frequencies of the full alphabet
+ * should be written before calling this.
+ */
+void
+MSAStats::compressAlphabet(double min_frequency)
+{
+  alphabet_map = arma::Mat<int>(Q, N);
+  for (int i = 0; i < N; i++) {
+    int states = 0;
+    bool lumped = false;
+    for (int aa = 0; aa < Q; aa++) {
+      if (frequency_1p.at(aa, i) > min_frequency) {
+        alphabet_map.at(aa, i) = states;
+        states++;
+      } else {
+        lumped = true;
+      }
+    }
+    for (int aa = 0; aa < Q; aa++) {
+      if (frequency_1p.at(aa, i) <= min_frequency) {
+        alphabet_map.at(aa, i) = states;
+      }
+    }
+    if (lumped) {
+      states++;
+    }
+    alphabet_sizes.at(i) = states;
+  }
+
+  // The relative entropy gradient of a lumped state uses the summed
+  // frequencies and background frequencies of its amino acids.
+  arma::Mat<double> tmp = frequency_1p * (1. - pseudocount);
+  tmp.each_col() += pseudocount * aa_background_frequencies;
+  arma::Mat<double> pos_freq = arma::Mat<double>(Q, N, arma::fill::zeros);
+  arma::Mat<double> background_freq =
+    arma::Mat<double>(Q, N, arma::fill::zeros);
+  arma::Mat<double> compressed_1p = arma::Mat<double>(Q, N, arma::fill::zeros);
+  for (int i = 0; i < N; i++) {
+    for (int aa = 0; aa < Q; aa++) {
+      int state = alphabet_map.at(aa, i);
+      compressed_1p.at(state, i) += frequency_1p.at(aa, i);
+      pos_freq.at(state, i) += tmp.at(aa, i);
+      background_freq.at(state, i) += aa_background_frequencies(aa);
+    }
+  }
+  frequency_1p = compressed_1p;
+
+  rel_entropy_grad_1p.zeros();
+  for (int i = 0; i < N; i++) {
+    for (int state = 0; state < alphabet_sizes.at(i); state++) {
+      double p = pos_freq.at(state, i);
+      double b = background_freq.at(state, i);
+      if (p < 1. && p > 0. && b > 0.) {
+        rel_entropy_grad_1p.at(state, i) =
+          log((p * (1. - b)) / ((1. - p) * b));
+      }
+    }
+  }
+
+  PairTensor compressed_2p = PairTensor(alphabet_sizes);
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      for (int aa1 = 0; aa1 < Q; aa1++) {
+        for (int aa2 = 0; aa2 < Q; aa2++) {
+          compressed_2p.at(i, j).at(alphabet_map.at(aa1, i),
+                                   alphabet_map.at(aa2, j)) +=
+            frequency_2p.at(i, j).at(aa1, aa2);
+        }
+      }
+    }
+  }
+  frequency_2p = std::move(compressed_2p);
+
+  int total_states = arma::accu(alphabet_sizes);
+  std::cout << "compressed alphabet to " << (double)total_states / N
+            << " states per position on average" << std::endl;
+};
+
 double
-MSAStats::getQ(void)
+MSAStats::getQ(void) const
 {
   return Q;
 };
 
 double
-MSAStats::getM(void)
+MSAStats::getM(void) const
 {
   return M;
 };
 
 double
-MSAStats::getN(void)
+MSAStats::getN(void) const
 {
   return N;
 };
 
 double
-MSAStats::getEffectiveM(void)
+MSAStats::getEffectiveM(void) const
 {
   return M_effective;
 };
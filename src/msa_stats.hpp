@@ -2,25 +2,33 @@
 #define MSA_STATS_HPP
 
 #include "msa.hpp"
+#include "msa_stream.hpp"
+#include "pair_tensor.hpp"
 
 #include <armadillo>
 
 class MSAStats
 {
 public:
-  MSAStats(MSA);
-  double getEffectiveM();
-  double getN();
-  double getM();
-  double getQ();
+  MSAStats(const MSA&);
+  MSAStats(MSAStream*, long int);
+  double getEffectiveM() const;
+  double getN() const;
+  double getM() const;
+  double getQ() const;
   void writeRelEntropyGradient(std::string);
   void writeFrequency1p(std::string);
   void writeFrequency2p(std::string);
+  void compressAlphabet(double);
 
   arma::Mat<double> frequency_1p;
-  arma::field<arma::Mat<double>> frequency_2p;
+  PairTensor frequency_2p;
   arma::Mat<double> rel_entropy_grad_1p;
 
+  arma::Col<int> alphabet_sizes; // number of states at each position
+  arma::Mat<int> alphabet_map;   // state of each amino acid at each position
+                                 // (empty unless the alphabet is compressed)
+
 private:
   double pseudocount;
   int M;              // number of sequences
@@ -29,6 +37,10 @@ private:
   double M_effective; // effect number of sequences
 
   arma::Col<double> aa_background_frequencies;
+
+  void initializeFrequencies(void);
+  void accumulateCounts(const arma::Mat<int>&, const arma::Col<double>&, int);
+  void finalizeFrequencies(void);
 };
 
 #endif
@@ -0,0 +1,187 @@
+#include "msa_stream.hpp"
+
+#include <armadillo>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+
+#include "msa.hpp"
+#include "utils.hpp"
+
+#ifndef AA_ALPHABET_SIZE
+#define AA_ALPHABET_SIZE 21
+#endif
+
+MSAStream::MSAStream(std::string msa_file,
+                     std::string weights_file,
+                     bool is_numeric_msa)
+  : msa_file(msa_file)
+{
+  if (!weights_file.empty()) {
+    weights_stream.open(weights_file);
+    if (!weights_stream) {
+      std::cerr << "ERROR: couldn't open '" << weights_file
+                << "' for reading." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    weights_given = true;
+  }
+
+  if (is_numeric_msa && isBinaryMSA(msa_file)) {
+    format = BINARY;
+    msa_binary_header header;
+    map = mapBinaryMSA(msa_file, &header, &map_size);
+    M_total = header.M;
+    N = header.N;
+    Q = header.Q;
+    return;
+  }
+
+  input_stream.open(msa_file);
+  if (!input_stream) {
+    std::cerr << "ERROR: couldn't open '" << msa_file << "' for reading."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  if (is_numeric_msa) {
+    format = NUMERIC;
+    std::string line;
+    input_stream >> M_total >> N >> Q;
+    std::getline(input_stream, line);
+  } else {
+    format = FASTA;
+    Q = AA_ALPHABET_SIZE;
+    N = 0;
+    pending = readFastaRecord(&pending_sequence);
+    for (auto aa = pending_sequence.begin(); aa != pending_sequence.end();
+         aa++) {
+      if (aaToNumeric(*aa) >= 0) {
+        N++;
+      }
+    }
+  }
+};
+
+MSAStream::~MSAStream(void)
+{
+  if (map != nullptr) {
+    munmap((void*)map, map_size);
+  }
+};
+
+bool
+MSAStream::readFastaRecord(std::string* sequence)
+{
+  sequence->clear();
+  bool in_record = next_record_started;
+  std::string line;
+  while (std::getline(input_stream, line)) {
+    if (line.empty()) {
+      continue;
+    } else if (line[0] == '>') {
+      if (in_record) {
+        next_record_started = true;
+        return true;
+      }
+      in_record = true;
+    } else if (in_record) {
+      *sequence += line;
+    }
+  }
+  next_record_started = false;
+  return in_record;
+};
+
+bool
+MSAStream::readNextSequence(arma::Mat<int>* chunk, int row)
+{
+  if (format == FASTA) {
+    std::string sequence;
+    if (pending) {
+      sequence.swap(pending_sequence);
+      pending = false;
+    } else if (!readFastaRecord(&sequence)) {
+      return false;
+    }
+    int col_idx = 0;
+    for (auto aa = sequence.begin(); aa != sequence.end(); aa++) {
+      int aa_num = aaToNumeric(*aa);
+      if (aa_num >= 0) {
+        if (col_idx == N) {
+          col_idx++;
+          break;
+        }
+        chunk->at(row, col_idx) = aa_num;
+        col_idx++;
+      }
+    }
+    if (col_idx != N) {
+      std::cerr << "ERROR: sequence length mismatch in '" << msa_file << "'."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  } else if (format == NUMERIC) {
+    if (rows_read == M_total) {
+      return false;
+    }
+    for (int i = 0; i < N; i++) {
+      input_stream >> chunk->at(row, i);
+    }
+    if (!input_stream) {
+      std::cerr << "ERROR: '" << msa_file << "' is truncated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  } else {
+    if (rows_read == M_total) {
+      return false;
+    }
+    const unsigned char* row_ptr =
+      map + sizeof(msa_binary_header) + (size_t)rows_read * N;
+    for (int i = 0; i < N; i++) {
+      chunk->at(row, i) = *(row_ptr + i);
+    }
+  }
+  return true;
+};
+
+double
+MSAStream::readNextWeight(void)
+{
+  double weight = 1.;
+  if (weights_given) {
+    if (!(weights_stream >> weight)) {
+      std::cerr << "ERROR: fewer sequence weights than sequences in '"
+                << msa_file << "'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  } else if (format == BINARY) {
+    std::memcpy(&weight,
+                map + sizeof(msa_binary_header) + 2 * (size_t)M_total * N +
+                  (size_t)rows_read * sizeof(double),
+                sizeof(double));
+  }
+  return weight;
+};
+
+/*
+ * Fill up to chunk->n_rows sequences (and their weights) and return how many
+ * were read. A return value of 0 means that the alignment is exhausted.
+ */
+int
+MSAStream::readChunk(arma::Mat<int>* chunk, arma::Col<double>* weights)
+{
+  int rows = 0;
+  while (rows < (int)chunk->n_rows) {
+    if (!readNextSequence(chunk, rows)) {
+      break;
+    }
+    weights->at(rows) = readNextWeight();
+    rows_read++;
+    rows++;
+  }
+  return rows;
+};
@@ -0,0 +1,56 @@
+#ifndef MSA_STREAM_HPP
+#define MSA_STREAM_HPP
+
+#include <armadillo>
+#include <fstream>
+#include <string>
+
+#include "msa.hpp"
+
+/*
+ * Sequential reader for alignments that are too large to hold in memory.
+ * Sequences are returned in chunks, together with their weights, either from
+ * a weights file read in lockstep, from the weights stored in a binary
+ * alignment, or uniform if neither is available.
+ */
+class MSAStream
+{
+public:
+  int N; // number of positions
+  int Q; // number of amino acids
+
+  MSAStream(std::string, std::string = "", bool = false);
+  ~MSAStream(void);
+  int readChunk(arma::Mat<int>*, arma::Col<double>*);
+
+private:
+  enum
+  {
+    FASTA,
+    NUMERIC,
+    BINARY
+  } format;
+
+  std::string msa_file;
+  std::ifstream input_stream;
+  std::ifstream weights_stream;
+  bool weights_given = false;
+
+  // FASTA lookahead: the first record is read in the constructor to find N,
+  // and a header line is consumed before the sequence that follows it.
+  bool next_record_started = false;
+  std::string pending_sequence;
+  bool pending = false;
+
+  // Binary alignments are mapped rather than read.
+  const unsigned char* map = nullptr;
+  size_t map_size = 0;
+  int M_total = 0;
+  int rows_read = 0;
+
+  bool readFastaRecord(std::string*);
+  bool readNextSequence(arma::Mat<int>*, int);
+  double readNextWeight(void);
+};
+
+#endif
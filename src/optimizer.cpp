@@ -0,0 +1,104 @@
+#include "optimizer.hpp"
+
+#include <armadillo>
+#include <cmath>
+#include <fstream>
+#include <string>
+
+Optimizer::Optimizer(long int n_params, int n_states)
+  : n_states(n_states)
+  , updates(0)
+{
+  state = arma::Mat<double>(n_params, n_states, arma::fill::zeros);
+};
+
+void
+Optimizer::beginUpdate(void)
+{
+  updates++;
+};
+
+/*
+ * Write the state as an Armadillo binary matrix, with one row per parameter
+ * and one column per state vector, followed by a row that holds the number of
+ * updates.
+ */
+bool
+Optimizer::save(std::string output_file) const
+{
+  std::ofstream stream(output_file, std::ios::binary);
+  return save(stream);
+};
+
+bool
+Optimizer::save(std::ostream& stream) const
+{
+  arma::Mat<double> output = state;
+  output.insert_rows(state.n_rows, 1);
+  output.at(state.n_rows, 0) = updates;
+  return output.save(stream, arma::arma_binary);
+};
+
+bool
+Optimizer::load(std::string input_file)
+{
+  std::ifstream stream(input_file, std::ios::binary);
+  return load(stream);
+};
+
+bool
+Optimizer::load(std::istream& stream)
+{
+  arma::Mat<double> input;
+  if (!input.load(stream, arma::arma_binary)) {
+    return false;
+  }
+  if ((input.n_rows != state.n_rows + 1) || (input.n_cols != state.n_cols)) {
+    return false;
+  }
+  updates = (long int)input.at(state.n_rows, 0);
+  input.shed_row(state.n_rows);
+  state = input;
+  return true;
+};
+
+AdamOptimizer::AdamOptimizer(long int n_params,
+                             double beta1,
+                             double beta2,
+                             double epsilon)
+  : Optimizer(n_params, 2)
+  , beta1(beta1)
+  , beta2(beta2)
+  , epsilon(epsilon)
+  , correction1(1)
+  , correction2(1){};
+
+void
+AdamOptimizer::beginUpdate(void)
+{
+  Optimizer::beginUpdate();
+  correction1 = 1 - pow(beta1, updates);
+  correction2 = 1 - pow(beta2, updates);
+};
+
+double
+AdamOptimizer::step(long int index, double grad, double rate)
+{
+  double m = beta1 * state.at(index, 0) + (1 - beta1) * grad;
+  double v = beta2 * state.at(index, 1) + (1 - beta2) * grad * grad;
+  state.at(index, 0) = m;
+  state.at(index, 1) = v;
+  return rate * (m / correction1) / (sqrt(v / correction2) + epsilon);
+};
+
+NesterovOptimizer::NesterovOptimizer(long int n_params, double momentum)
+  : Optimizer(n_params, 1)
+  , momentum(momentum){};
+
+double
+NesterovOptimizer::step(long int index, double grad, double rate)
+{
+  double velocity = momentum * state.at(index, 0) + grad;
+  state.at(index, 0) = velocity;
+  return rate * (grad + momentum * velocity);
+};
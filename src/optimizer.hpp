@@ -0,0 +1,72 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <armadillo>
+#include <iostream>
+#include <string>
+
+/*
+ * Update rule for the Potts parameters, used instead of the default
+ * sign-agreement adaptive learning rates. Parameters are indexed as the fields
+ * (Q x N, column-major) followed by the couplings in packed pair order.
+ * step() takes the gradient (ascent direction) and learning rate of one
+ * parameter, updates the optimizer's state for that parameter and returns the
+ * change to apply to it. Distinct parameters can be stepped concurrently, and
+ * beginUpdate() is called once before each update.
+ */
+class Optimizer
+{
+public:
+  Optimizer(long int, int);
+  virtual ~Optimizer(void){};
+
+  virtual void beginUpdate(void);
+  virtual double step(long int, double, double) = 0;
+
+  bool save(std::string) const;
+  bool save(std::ostream&) const;
+  bool load(std::string);
+  bool load(std::istream&);
+
+  int n_states; // number of state vectors
+
+protected:
+  arma::Mat<double> state; // one row per parameter, one column per vector
+  long int updates;        // number of updates so far
+};
+
+/*
+ * Adam: steps are the bias-corrected first moment of the gradient divided by
+ * the square root of its bias-corrected second moment, times the learning
+ * rate.
+ */
+class AdamOptimizer : public Optimizer
+{
+public:
+  AdamOptimizer(long int, double, double, double);
+  void beginUpdate(void);
+  double step(long int, double, double);
+
+private:
+  double beta1;   // decay of the first moment
+  double beta2;   // decay of the second moment
+  double epsilon; // added to the root of the second moment
+  double correction1;
+  double correction2;
+};
+
+/*
+ * Nesterov momentum: the velocity accumulates the gradients, and steps look
+ * ahead along the updated velocity.
+ */
+class NesterovOptimizer : public Optimizer
+{
+public:
+  NesterovOptimizer(long int, double);
+  double step(long int, double, double);
+
+private:
+  double momentum;
+};
+
+#endif
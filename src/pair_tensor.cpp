@@ -0,0 +1,177 @@
+#include "pair_tensor.hpp"
+
+#include <armadillo>
+#include <utility>
+
+PairTensor::PairTensor(void)
+  : N(0)
+  , n_pairs(0)
+  , n_elem(0){};
+
+PairTensor::PairTensor(int n, int q)
+  : N(n)
+{
+  alphabet_sizes = arma::Col<int>(N);
+  alphabet_sizes.fill(q);
+  allocate();
+};
+
+PairTensor::PairTensor(const arma::Col<int>& sizes)
+  : N(sizes.n_elem)
+  , alphabet_sizes(sizes)
+{
+  allocate();
+};
+
+PairTensor::PairTensor(const PairTensor& other)
+  : N(other.N)
+  , n_pairs(other.n_pairs)
+  , n_elem(other.n_elem)
+  , alphabet_sizes(other.alphabet_sizes)
+  , data(other.data)
+{
+  bind();
+};
+
+PairTensor::PairTensor(PairTensor&& other)
+  : N(other.N)
+  , n_pairs(other.n_pairs)
+  , n_elem(other.n_elem)
+  , alphabet_sizes(std::move(other.alphabet_sizes))
+  , data(std::move(other.data))
+{
+  bind();
+
+  other.N = 0;
+  other.n_pairs = 0;
+  other.n_elem = 0;
+  other.alphabet_sizes.reset();
+  other.data.reset();
+  other.blocks.clear();
+};
+
+PairTensor&
+PairTensor::operator=(const PairTensor& other)
+{
+  if (this != &other) {
+    N = other.N;
+    n_pairs = other.n_pairs;
+    n_elem = other.n_elem;
+    alphabet_sizes = other.alphabet_sizes;
+    data = other.data;
+    bind();
+  }
+  return *this;
+};
+
+PairTensor&
+PairTensor::operator=(PairTensor&& other)
+{
+  if (this != &other) {
+    N = other.N;
+    n_pairs = other.n_pairs;
+    n_elem = other.n_elem;
+    alphabet_sizes = std::move(other.alphabet_sizes);
+    data = std::move(other.data);
+    bind();
+
+    other.N = 0;
+    other.n_pairs = 0;
+    other.n_elem = 0;
+    other.alphabet_sizes.reset();
+    other.data.reset();
+    other.blocks.clear();
+  }
+  return *this;
+};
+
+/*
+ * Allocate zeroed storage for all blocks, given N and alphabet_sizes.
+ */
+void
+PairTensor::allocate(void)
+{
+  n_pairs = N * (N - 1) / 2;
+  n_elem = 0;
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      n_elem += alphabet_sizes.at(i) * alphabet_sizes.at(j);
+    }
+  }
+  data = arma::Col<double>(n_elem, arma::fill::zeros);
+  bind();
+};
+
+/*
+ * Point the block matrices at the current storage. This must be called
+ * whenever 'data' is reallocated, copied or moved.
+ */
+void
+PairTensor::bind(void)
+{
+  blocks.clear();
+  blocks.reserve(n_pairs);
+  double* ptr = data.memptr();
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      blocks.emplace_back(
+        ptr, alphabet_sizes.at(i), alphabet_sizes.at(j), false, true);
+      ptr += alphabet_sizes.at(i) * alphabet_sizes.at(j);
+    }
+  }
+};
+
+void
+PairTensor::zeros(void)
+{
+  data.zeros();
+};
+
+void
+PairTensor::fill(double value)
+{
+  data.fill(value);
+};
+
+/*
+ * Write the blocks as an N x N arma::field, with empty blocks for i >= j, so
+ * that files keep the format of earlier versions.
+ */
+bool
+PairTensor::save(std::string output_file) const
+{
+  arma::field<arma::Mat<double>> field = arma::field<arma::Mat<double>>(N, N);
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      field.at(i, j) = at(i, j);
+    }
+  }
+  return field.save(output_file, arma::arma_binary);
+};
+
+/*
+ * Read blocks written as an N x N arma::field. Blocks for i >= j are ignored.
+ */
+bool
+PairTensor::load(std::string input_file)
+{
+  arma::field<arma::Mat<double>> field;
+  if (!field.load(input_file)) {
+    return false;
+  }
+
+  N = field.n_rows;
+  alphabet_sizes = arma::Col<int>(N, arma::fill::zeros);
+  for (int i = 0; i + 1 < N; i++) {
+    alphabet_sizes.at(i) = field.at(i, i + 1).n_rows;
+    alphabet_sizes.at(i + 1) = field.at(i, i + 1).n_cols;
+  }
+  allocate();
+
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      at(i, j) = field.at(i, j);
+    }
+  }
+  return true;
+};
@@ -0,0 +1,63 @@
+#ifndef PAIR_TENSOR_HPP
+#define PAIR_TENSOR_HPP
+
+#include <armadillo>
+#include <string>
+#include <vector>
+
+/*
+ * Blocks of values for each pair of positions i < j, such as couplings or 2p
+ * frequencies. The (i, j) block is Q_i x Q_j. All blocks are packed, in pair
+ * order, into a single contiguous allocation, and at(i, j) returns an
+ * Armadillo matrix that aliases the block's memory, so that blocks can be
+ * used like the matrices of an arma::field. Only the upper triangle (i < j)
+ * is stored.
+ */
+class PairTensor
+{
+public:
+  PairTensor(void);
+  PairTensor(int, int);
+  PairTensor(const arma::Col<int>&);
+  PairTensor(const PairTensor&);
+  PairTensor(PairTensor&&);
+  PairTensor& operator=(const PairTensor&);
+  PairTensor& operator=(PairTensor&&);
+
+  arma::Mat<double>& at(int i, int j) { return blocks[pairIndex(i, j)]; };
+  const arma::Mat<double>& at(int i, int j) const
+  {
+    return blocks[pairIndex(i, j)];
+  };
+  arma::Mat<double>& at(int pair) { return blocks[pair]; };
+  const arma::Mat<double>& at(int pair) const { return blocks[pair]; };
+
+  // Index of the (i, j) block, for i < j, in the packed storage.
+  int pairIndex(int i, int j) const
+  {
+    return i * N - i * (i + 1) / 2 + j - i - 1;
+  };
+
+  double* memptr(void) { return data.memptr(); };
+  const double* memptr(void) const { return data.memptr(); };
+
+  void zeros(void);
+  void fill(double);
+
+  bool save(std::string) const;
+  bool load(std::string);
+
+  int N;                         // number of positions
+  int n_pairs;                   // number of blocks, N * (N - 1) / 2
+  long int n_elem;               // total number of values
+  arma::Col<int> alphabet_sizes; // number of states at each position
+
+private:
+  arma::Col<double> data;
+  std::vector<arma::Mat<double>> blocks;
+
+  void allocate(void);
+  void bind(void);
+};
+
+#endif
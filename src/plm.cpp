@@ -0,0 +1,267 @@
+#include "plm.hpp"
+
+#include <armadillo>
+#include <cmath>
+#include <vector>
+
+#include "msa.hpp"
+#include "pair_tensor.hpp"
+#include "utils.hpp"
+
+#define LBFGS_HISTORY 10
+#define LBFGS_TOLERANCE 1e-5
+
+/*
+ * Sequences are mapped to the states of the model with 'alphabet_map' (see
+ * MSAStats::compressAlphabet()), or used as is if it is empty.
+ */
+PseudoLikelihood::PseudoLikelihood(const MSA& msa,
+                                   const arma::Col<int>& alphabet_sizes,
+                                   const arma::Mat<int>& alphabet_map,
+                                   double lambda_h,
+                                   double lambda_J)
+  : M(msa.M)
+  , N(msa.N)
+  , alphabet_sizes(alphabet_sizes)
+  , lambda_h(lambda_h)
+  , lambda_J(lambda_J)
+{
+  states = msa.alignment;
+  if (!alphabet_map.is_empty()) {
+    for (int m = 0; m < M; m++) {
+      for (int i = 0; i < N; i++) {
+        states.at(m, i) = alphabet_map.at(states.at(m, i), i);
+      }
+    }
+  }
+  weights = msa.sequence_weights / arma::accu(msa.sequence_weights);
+};
+
+/*
+ * Negative log pseudo-likelihood of position r, plus regularization, and its
+ * gradient. 'x' holds the fields of r, followed by the couplings between r
+ * and each other position j (Q_r x Q_j, column-major), in increasing j.
+ */
+double
+PseudoLikelihood::evaluate(int r,
+                           const arma::Col<double>& x,
+                           arma::Col<double>* grad) const
+{
+  int Q_r = alphabet_sizes.at(r);
+  std::vector<long int> offsets(N, 0);
+  long int offset = Q_r;
+  for (int j = 0; j < N; j++) {
+    if (j != r) {
+      offsets[j] = offset;
+      offset += Q_r * alphabet_sizes.at(j);
+    }
+  }
+
+  grad->zeros();
+  double f = 0;
+  std::vector<double> energies(Q_r);
+  for (int m = 0; m < M; m++) {
+    for (int a = 0; a < Q_r; a++) {
+      energies[a] = x.at(a);
+    }
+    for (int j = 0; j < N; j++) {
+      if (j != r) {
+        const double* J_rj = x.memptr() + offsets[j] + Q_r * states.at(m, j);
+        for (int a = 0; a < Q_r; a++) {
+          energies[a] += J_rj[a];
+        }
+      }
+    }
+    double e_max = energies[0];
+    for (int a = 1; a < Q_r; a++) {
+      e_max = Max(e_max, energies[a]);
+    }
+    double Z = 0;
+    for (int a = 0; a < Q_r; a++) {
+      Z += exp(energies[a] - e_max);
+    }
+    double log_Z = e_max + log(Z);
+    int s_r = states.at(m, r);
+    double w = weights.at(m);
+    f -= w * (energies[s_r] - log_Z);
+
+    for (int a = 0; a < Q_r; a++) {
+      double d = w * (exp(energies[a] - log_Z) - Delta(a - s_r));
+      grad->at(a) += d;
+      for (int j = 0; j < N; j++) {
+        if (j != r) {
+          grad->at(offsets[j] + Q_r * states.at(m, j) + a) += d;
+        }
+      }
+    }
+  }
+
+  for (long int k = 0; k < (long int)x.n_elem; k++) {
+    double lambda = (k < Q_r) ? lambda_h : lambda_J;
+    f += lambda * x.at(k) * x.at(k);
+    grad->at(k) += 2 * lambda * x.at(k);
+  }
+  return f;
+};
+
+/*
+ * Minimize the objective of position r with L-BFGS and a backtracking line
+ * search, starting from and overwriting 'x'.
+ */
+void
+PseudoLikelihood::minimize(int r, arma::Col<double>* x, int max_iterations) const
+{
+  arma::uword n = x->n_elem;
+  arma::Col<double> grad = arma::Col<double>(n);
+  arma::Col<double> new_grad = arma::Col<double>(n);
+  double f = evaluate(r, *x, &grad);
+
+  std::vector<arma::Col<double>> s_history;
+  std::vector<arma::Col<double>> y_history;
+  std::vector<double> rho_history;
+
+  for (int iteration = 0; iteration < max_iterations; iteration++) {
+    if (arma::abs(grad).max() < LBFGS_TOLERANCE) {
+      break;
+    }
+
+    // Two-loop recursion for the search direction.
+    arma::Col<double> direction = -grad;
+    int history = s_history.size();
+    std::vector<double> alpha(history);
+    for (int k = history - 1; k >= 0; k--) {
+      alpha[k] = rho_history[k] * arma::dot(s_history[k], direction);
+      direction -= alpha[k] * y_history[k];
+    }
+    if (history > 0) {
+      direction *= arma::dot(s_history[history - 1], y_history[history - 1]) /
+                   arma::dot(y_history[history - 1], y_history[history - 1]);
+    } else {
+      direction /= Max(arma::norm(grad), 1.0);
+    }
+    for (int k = 0; k < history; k++) {
+      double beta = rho_history[k] * arma::dot(y_history[k], direction);
+      direction += (alpha[k] - beta) * s_history[k];
+    }
+
+    double slope = arma::dot(grad, direction);
+    if (slope >= 0) {
+      direction = -grad;
+      slope = -arma::dot(grad, grad);
+      s_history.clear();
+      y_history.clear();
+      rho_history.clear();
+    }
+
+    // Backtracking line search (Armijo condition).
+    double step = 1;
+    arma::Col<double> new_x;
+    double new_f = f;
+    bool accepted = false;
+    for (int trial = 0; trial < 30; trial++) {
+      new_x = *x + step * direction;
+      new_f = evaluate(r, new_x, &new_grad);
+      if (new_f <= f + 1e-4 * step * slope) {
+        accepted = true;
+        break;
+      }
+      step *= 0.5;
+    }
+    if (!accepted) {
+      break;
+    }
+
+    arma::Col<double> s = new_x - *x;
+    arma::Col<double> y = new_grad - grad;
+    double sy = arma::dot(s, y);
+    if (sy > 1e-12) {
+      if ((int)s_history.size() == LBFGS_HISTORY) {
+        s_history.erase(s_history.begin());
+        y_history.erase(y_history.begin());
+        rho_history.erase(rho_history.begin());
+      }
+      s_history.push_back(s);
+      y_history.push_back(y);
+      rho_history.push_back(1. / sy);
+    }
+
+    *x = new_x;
+    grad = new_grad;
+    f = new_f;
+  }
+};
+
+/*
+ * Fit all conditionals (in parallel over positions) and write the fields and
+ * couplings to 'params', which must be allocated for the model's alphabet.
+ */
+void
+PseudoLikelihood::fit(potts_model* params, int max_iterations)
+{
+  std::vector<arma::Col<double>> solutions(N);
+  std::vector<std::vector<long int>> offsets(N);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int r = 0; r < N; r++) {
+    int Q_r = alphabet_sizes.at(r);
+    offsets[r] = std::vector<long int>(N, 0);
+    long int offset = Q_r;
+    for (int j = 0; j < N; j++) {
+      if (j != r) {
+        offsets[r][j] = offset;
+        offset += Q_r * alphabet_sizes.at(j);
+      }
+    }
+    solutions[r] = arma::Col<double>(offset, arma::fill::zeros);
+    minimize(r, &solutions[r], max_iterations);
+  }
+
+  // Couplings of position i with j, as fit by the conditional of i
+  // (Q_i x Q_j).
+  auto block = [&](int i, int j) {
+    return arma::Mat<double>(solutions[i].memptr() + offsets[i][j],
+                             alphabet_sizes.at(i),
+                             alphabet_sizes.at(j));
+  };
+
+  // Zero-sum gauge: the couplings sum to zero over each state of either
+  // position, and the fields over the states of their position. The fields
+  // of i absorb the shifts of the couplings of its own conditional.
+  params->h.zeros();
+  for (int i = 0; i < N; i++) {
+    int Q_i = alphabet_sizes.at(i);
+    arma::Col<double> h_i = solutions[i].subvec(0, Q_i - 1);
+    h_i -= arma::mean(h_i);
+    for (int j = 0; j < N; j++) {
+      if (j != i) {
+        arma::Mat<double> J_ij = block(i, j);
+        arma::Col<double> row_means = arma::mean(J_ij, 1);
+        h_i += row_means - arma::mean(row_means);
+      }
+    }
+    for (int a = 0; a < Q_i; a++) {
+      params->h.at(a, i) = h_i.at(a);
+    }
+  }
+
+  auto zero_sum = [](const arma::Mat<double>& J) {
+    arma::Mat<double> centered = J;
+    arma::Col<double> row_means = arma::mean(J, 1);
+    arma::Row<double> col_means = arma::mean(J, 0);
+    double mean = arma::mean(row_means);
+    for (arma::uword b = 0; b < J.n_cols; b++) {
+      for (arma::uword a = 0; a < J.n_rows; a++) {
+        centered.at(a, b) += mean - row_means.at(a) - col_means.at(b);
+      }
+    }
+    return centered;
+  };
+
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      arma::Mat<double> from_i = zero_sum(block(i, j));
+      arma::Mat<double> from_j = zero_sum(block(j, i));
+      params->J.at(i, j) = 0.5 * (from_i + from_j.t());
+    }
+  }
+};
@@ -0,0 +1,40 @@
+#ifndef PLM_HPP
+#define PLM_HPP
+
+#include <armadillo>
+
+#include "msa.hpp"
+#include "utils.hpp"
+
+/*
+ * Pseudo-likelihood maximization (asymmetric plmDCA), used to initialize the
+ * parameters before Boltzmann machine learning. The conditional distribution
+ * of each position given the others is fit independently, with L2
+ * regularization, by L-BFGS. The couplings of the two conditionals that
+ * involve a pair are then averaged, and all parameters are returned in the
+ * zero-sum gauge. Positions can have different numbers of states.
+ */
+class PseudoLikelihood
+{
+public:
+  PseudoLikelihood(const MSA&,
+                   const arma::Col<int>&,
+                   const arma::Mat<int>&,
+                   double,
+                   double);
+  void fit(potts_model*, int);
+
+private:
+  int M;                         // number of sequences
+  int N;                         // number of positions
+  arma::Col<int> alphabet_sizes; // number of states at each position
+  arma::Mat<int> states;         // sequences, in model states (M x N)
+  arma::Col<double> weights;     // sequence weights, summing to 1
+  double lambda_h;               // L2 regularization strength for fields
+  double lambda_J;               // L2 regularization strength for couplings
+
+  double evaluate(int, const arma::Col<double>&, arma::Col<double>*) const;
+  void minimize(int, arma::Col<double>*, int) const;
+};
+
+#endif
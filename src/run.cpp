@@ -1,22 +1,99 @@
 #include "run.hpp"
 
+#include <algorithm>
 #include <armadillo>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <random>
+#include <sstream>
 #include <string>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 #include "model.hpp"
 #include "msa.hpp"
 #include "msa_stats.hpp"
+#include "optimizer.hpp"
 #include "pcg_random.hpp"
+#include "plm.hpp"
 #include "utils.hpp"
 
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
 #define EPSILON 0.00000001
 
+// Checkpoint format (see Sim::writeCheckpoint()).
+#define CHECKPOINT_FILE "checkpoint.bin"
+#define CHECKPOINT_MAGIC "BMDCACKP"
+#define CHECKPOINT_VERSION 6
+
+// Last checkpoint signal received (SIGTERM or SIGUSR1), or 0.
+static volatile std::sig_atomic_t checkpoint_signal = 0;
+
+static void
+handleCheckpointSignal(int signal)
+{
+  checkpoint_signal = signal;
+};
+
+#ifdef USE_MPI
+// Commands sent by the root process to the worker processes, which sample
+// a share of the MCMC replicates (see Sim::runWorker()).
+#define COMMAND_LOAD_PARAMS 0
+#define COMMAND_SAMPLE 1
+#define COMMAND_COUNT 2
+#define COMMAND_STOP 3
+#define COMMAND_SIGNAL 4
+#define COMMAND_GATHER 5
+
+// MPI counts are ints, so large arrays are sent in chunks.
+#define CHUNK_SIZE 134217728
+
+static void
+sendCommand(int command)
+{
+  MPI_Bcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD);
+};
+
+static void
+broadcastArray(double* data, long int n)
+{
+  for (long int offset = 0; offset < n; offset += CHUNK_SIZE) {
+    int count = (int)std::min((long int)CHUNK_SIZE, n - offset);
+    MPI_Bcast(data + offset, count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  }
+};
+
+static void
+reduceArray(double* data, long int n, int rank)
+{
+  for (long int offset = 0; offset < n; offset += CHUNK_SIZE) {
+    int count = (int)std::min((long int)CHUNK_SIZE, n - offset);
+    if (rank == 0) {
+      MPI_Reduce(MPI_IN_PLACE,
+                 data + offset,
+                 count,
+                 MPI_DOUBLE,
+                 MPI_SUM,
+                 0,
+                 MPI_COMM_WORLD);
+    } else {
+      MPI_Reduce(
+        data + offset, nullptr, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+  }
+};
+#endif
+
 void
 Sim::initializeParameters(void)
 {
@@ -39,6 +116,28 @@ Sim::initializeParameters(void)
   min_step_J = 0.00001;
   max_step_J_N = 2.5; // divide by N later
   error_min_update = -1;
+  active_set_interval = 0; // screen all couplings at every step
+
+  // initialization settings
+  init_method = "profile"; // independent-site fields, zero couplings
+  plm_lambda_h = 0.01;
+  plm_lambda_J = 0.01;
+  plm_iterations = 100;
+  mf_pseudocount = 0.5;
+  init_parameters_file = "";
+  init_parameters_h_file = "";
+  init_parameters_J_file = "";
+  init_learning_rates_file = "";
+  init_learning_rates_h_file = "";
+  init_learning_rates_J_file = "";
+  init_position_map = ""; // same positions as the initial model
+
+  // optimizer settings
+  optimizer_name = "adaptive";
+  adam_beta1 = 0.9;
+  adam_beta2 = 0.999;
+  adam_epsilon = 1e-8;
+  nesterov_momentum = 0.9;
 
   // sampling time settings
   t_wait_0 = 10000;
@@ -46,6 +145,8 @@ Sim::initializeParameters(void)
   check_ergo = true;
   adapt_up_time = 1.5;
   adapt_down_time = 0.600;
+  ergo_iat = false;
+  extend_chains = true;
 
   output_binary = false;
 
@@ -55,10 +156,39 @@ Sim::initializeParameters(void)
 
   // mcmc settings
   use_ss = false;
-  M = 1000;            // importance sampling max iterations
-  count_max = 10;      // number of independent MCMC runs
-  init_sample = false; // flag to load first position for mcmc seqs
-  temperature = 1.0;   // temperature at which to sample mcmc
+  ss_chains = 0;
+  M = 1000;              // importance sampling max iterations
+  count_max = 10;        // number of independent MCMC runs
+  init_sample = false;   // flag to load first position for mcmc seqs
+  temperature = 1.0;     // temperature at which to sample mcmc
+  site_order = "random"; // a random position at each MCMC step
+  block_pairs = 0;       // no block updates of coupled pairs
+  block_rate = 0.1;      // fraction of MCMC steps that are block updates
+  chain_init = "random"; // chains start from random sequences
+  chain_init_file = "";
+
+  // sample size schedule settings
+  sample_schedule = "fixed"; // M samples per chain at every step
+  M_min = 100;               // samples per chain at the first step
+  sample_growth = 2.0;       // multiple by which to increase samples
+  sample_error_drop = 0.5;   // error ratio between increases for 'error'
+  sample_snr_min = 2.0;      // signal-to-noise ratio below which to increase
+                             // samples for 'snr'
+
+  // alphabet compression settings
+  compress_alphabet = false;
+  alphabet_min_frequency = 0.001;
+
+  // memory settings
+  lean_memory = false;
+
+  // asynchronous sampling settings
+  async_sampling = false;
+  async_threads = 0;          // all cores but one
+  async_fresh_fraction = 0.5; // fraction of chains resampled between updates
+
+  // checkpoint settings
+  checkpoint_interval = 0; // only on SIGTERM or SIGUSR1
 
   // // check routine settings
   // t_wait_check = t_wait_0;
@@ -77,11 +207,145 @@ Sim::checkParameters(void)
     count_max = (int)(round(msa_stats.getEffectiveM()));
   }
 
-  // Ensure that the set of ergodiciy checks is disabled if M=1
-  if ((M == 1) && check_ergo) {
+  // Persistent chains only replace the single-sample chains of use_ss, and
+  // each must emit at least one sample.
+  if (!use_ss || (ss_chains < 0)) {
+    ss_chains = 0;
+  }
+  if (ss_chains > count_max) {
+    ss_chains = count_max;
+    std::cerr << "WARNING: reducing 'ss_chains' to count_max (" << count_max
+              << ")." << std::endl;
+  }
+  if (async_sampling && (ss_chains > 0)) {
+    ss_chains = 0;
+    std::cerr << "WARNING: disabling 'ss_chains' when 'async_sampling' is "
+                 "set."
+              << std::endl;
+  }
+
+  // Ensure that the set of ergodiciy checks is disabled if M=1, unless the
+  // samples come from persistent chains, whose autocorrelation times set the
+  // wait time between their samples.
+  if ((ss_chains > 0) && check_ergo) {
+    ergo_iat = true;
+  } else if ((M == 1) && check_ergo) {
     check_ergo = false;
     std::cerr << "WARNING: disabling 'check_ergo' when M=1." << std::endl;
   }
+
+  if ((site_order != "random") && (site_order != "sweep") &&
+      (site_order != "shuffled")) {
+    std::cerr << "ERROR: unknown site order '" << site_order << "'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if (block_pairs < 0) {
+    block_pairs = 0;
+  }
+  if ((block_rate < 0) || (block_rate > 1)) {
+    std::cerr << "ERROR: 'block_rate' must be between 0 and 1." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  // Importance sampling needs the parameters of the previous step, which are
+  // not kept in lean mode.
+  if (lean_memory && (step_importance_max > 1)) {
+    step_importance_max = 1;
+    std::cerr << "WARNING: disabling importance sampling when 'lean_memory' "
+                 "is set."
+              << std::endl;
+  }
+
+  if ((init_method != "profile") && (init_method != "plm") &&
+      (init_method != "mf") && (init_method != "parameters")) {
+    std::cerr << "ERROR: unknown initialization '" << init_method
+              << "' (expected 'profile', 'plm', 'mf' or 'parameters')."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if ((init_method == "parameters") && init_parameters_file.empty() &&
+      (init_parameters_h_file.empty() || init_parameters_J_file.empty())) {
+    std::cerr << "ERROR: 'init=parameters' needs 'init_parameters_file', or "
+                 "both 'init_parameters_h_file' and 'init_parameters_J_file'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  if ((chain_init != "random") && (chain_init != "msa") &&
+      (chain_init != "file")) {
+    std::cerr << "ERROR: unknown chain initialization '" << chain_init
+              << "' (expected 'random', 'msa' or 'file')." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if ((chain_init == "file") && chain_init_file.empty()) {
+    std::cerr << "ERROR: 'chain_init=file' needs 'chain_init_file'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if (init_sample && (chain_init != "random")) {
+    std::cerr << "ERROR: 'init_sample' cannot be combined with 'chain_init'."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  if ((optimizer_name != "adaptive") && (optimizer_name != "adam") &&
+      (optimizer_name != "nesterov")) {
+    std::cerr << "ERROR: unknown optimizer '" << optimizer_name
+              << "' (expected 'adaptive', 'adam' or 'nesterov')." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  // The active set only holds couplings whose statistics are significant,
+  // which needs a threshold.
+  if ((active_set_interval > 0) && (error_min_update <= 0)) {
+    active_set_interval = 0;
+    std::cerr << "WARNING: disabling 'active_set_interval' when "
+                 "'error_min_update' is not positive."
+              << std::endl;
+  }
+
+  // Asynchronous chains are sampled with fixed burn-in and wait times, and
+  // each update only sees the latest samples.
+  if (async_sampling && check_ergo) {
+    check_ergo = false;
+    std::cerr << "WARNING: disabling 'check_ergo' when 'async_sampling' is "
+                 "set."
+              << std::endl;
+  }
+  if (async_sampling && (step_importance_max > 1)) {
+    step_importance_max = 1;
+    std::cerr << "WARNING: disabling importance sampling when "
+                 "'async_sampling' is set."
+              << std::endl;
+  }
+  if (async_sampling &&
+      ((async_fresh_fraction <= 0) || (async_fresh_fraction > 1))) {
+    std::cerr << "ERROR: 'async_fresh_fraction' must be in (0, 1]."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if ((sample_schedule != "fixed") && (sample_schedule != "error") &&
+      (sample_schedule != "snr")) {
+    std::cerr << "ERROR: unknown sample schedule '" << sample_schedule
+              << "' (expected 'fixed', 'error' or 'snr')." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if ((sample_schedule != "fixed") && (use_ss || async_sampling)) {
+    sample_schedule = "fixed";
+    std::cerr << "WARNING: disabling 'sample_schedule' when 'use_ss' or "
+                 "'async_sampling' is set."
+              << std::endl;
+  }
+  if ((sample_schedule != "fixed") && (sample_growth <= 1)) {
+    std::cerr << "ERROR: 'sample_growth' must be greater than 1." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if (async_sampling && (checkpoint_interval > 0)) {
+    checkpoint_interval = 0;
+    std::cerr << "WARNING: disabling checkpoints when 'async_sampling' is set."
+              << std::endl;
+  }
 }
 
 void
@@ -111,6 +375,31 @@ Sim::writeParameters(std::string output_file)
   stream << "min_step_J=" << min_step_J << std::endl;
   stream << "max_step_J_N=" << max_step_J_N << std::endl;
   stream << "error_min_update=" << error_min_update << std::endl;
+  stream << "active_set_interval=" << active_set_interval << std::endl;
+
+  // initialization settings
+  stream << "init=" << init_method << std::endl;
+  stream << "plm_lambda_h=" << plm_lambda_h << std::endl;
+  stream << "plm_lambda_J=" << plm_lambda_J << std::endl;
+  stream << "plm_iterations=" << plm_iterations << std::endl;
+  stream << "mf_pseudocount=" << mf_pseudocount << std::endl;
+  stream << "init_parameters_file=" << init_parameters_file << std::endl;
+  stream << "init_parameters_h_file=" << init_parameters_h_file << std::endl;
+  stream << "init_parameters_J_file=" << init_parameters_J_file << std::endl;
+  stream << "init_learning_rates_file=" << init_learning_rates_file
+         << std::endl;
+  stream << "init_learning_rates_h_file=" << init_learning_rates_h_file
+         << std::endl;
+  stream << "init_learning_rates_J_file=" << init_learning_rates_J_file
+         << std::endl;
+  stream << "init_position_map=" << init_position_map << std::endl;
+
+  // optimizer settings
+  stream << "optimizer=" << optimizer_name << std::endl;
+  stream << "adam_beta1=" << adam_beta1 << std::endl;
+  stream << "adam_beta2=" << adam_beta2 << std::endl;
+  stream << "adam_epsilon=" << adam_epsilon << std::endl;
+  stream << "nesterov_momentum=" << nesterov_momentum << std::endl;
 
   // sampling time settings
   stream << "t_wait_0=" << t_wait_0 << std::endl;
@@ -118,6 +407,8 @@ Sim::writeParameters(std::string output_file)
   stream << "check_ergo=" << check_ergo << std::endl;
   stream << "adapt_up_time=" << adapt_up_time << std::endl;
   stream << "adapt_down_time=" << adapt_down_time << std::endl;
+  stream << "ergo_iat=" << ergo_iat << std::endl;
+  stream << "extend_chains=" << extend_chains << std::endl;
 
   // importance sampling settings
   stream << "step_importance_max=" << step_importance_max << std::endl;
@@ -125,12 +416,40 @@ Sim::writeParameters(std::string output_file)
 
   // mcmc settings
   stream << "use_ss=" << use_ss << std::endl;
+  stream << "ss_chains=" << ss_chains << std::endl;
   stream << "M=" << M << std::endl;
   stream << "count_max=" << count_max << std::endl;
   stream << "init_sample=" << init_sample << std::endl;
   stream << "init_sample_file=" << init_sample_file << std::endl;
+  stream << "chain_init=" << chain_init << std::endl;
+  stream << "chain_init_file=" << chain_init_file << std::endl;
   stream << "use_pos_reg=" << use_pos_reg << std::endl;
   stream << "temperature=" << temperature << std::endl;
+  stream << "site_order=" << site_order << std::endl;
+  stream << "block_pairs=" << block_pairs << std::endl;
+  stream << "block_rate=" << block_rate << std::endl;
+
+  // sample size schedule settings
+  stream << "sample_schedule=" << sample_schedule << std::endl;
+  stream << "M_min=" << M_min << std::endl;
+  stream << "sample_growth=" << sample_growth << std::endl;
+  stream << "sample_error_drop=" << sample_error_drop << std::endl;
+  stream << "sample_snr_min=" << sample_snr_min << std::endl;
+
+  // alphabet compression settings
+  stream << "compress_alphabet=" << compress_alphabet << std::endl;
+  stream << "alphabet_min_frequency=" << alphabet_min_frequency << std::endl;
+
+  // memory settings
+  stream << "lean_memory=" << lean_memory << std::endl;
+
+  // asynchronous sampling settings
+  stream << "async_sampling=" << async_sampling << std::endl;
+  stream << "async_threads=" << async_threads << std::endl;
+  stream << "async_fresh_fraction=" << async_fresh_fraction << std::endl;
+
+  // checkpoint settings
+  stream << "checkpoint_interval=" << checkpoint_interval << std::endl;
 
   // // check routine settings
   // stream << "t_wait_check=" << t_wait_check << std::endl;
@@ -141,9 +460,14 @@ Sim::writeParameters(std::string output_file)
   stream << "output_binary=" << output_binary << std::endl;
 };
 
-void
-Sim::loadParameters(std::string file_name)
+/*
+ * Return the key-value pairs of the [bmDCA] section of a config file, in
+ * order.
+ */
+static std::vector<std::pair<std::string, std::string>>
+readConfigSection(std::string file_name)
 {
+  std::vector<std::pair<std::string, std::string>> settings;
   std::ifstream file(file_name);
   bool reading_bmdca_section = false;
   if (file.is_open()) {
@@ -164,13 +488,46 @@ Sim::loadParameters(std::string file_name)
         auto delim_pos = line.find("=");
         auto key = line.substr(0, delim_pos);
         auto value = line.substr(delim_pos + 1);
-        setParameter(key, value);
+        settings.push_back(std::make_pair(key, value));
       }
     }
   } else {
     std::cerr << "ERROR: " << file_name << " not found." << std::endl;
     std::exit(EXIT_FAILURE);
   }
+  return settings;
+};
+
+void
+Sim::loadParameters(std::string file_name)
+{
+  for (auto& setting : readConfigSection(file_name)) {
+    setParameter(setting.first, setting.second);
+  }
+};
+
+/*
+ * Whether the run set by config_file uses the sequences of the alignment once
+ * the Sim is constructed: to initialize the parameters by pseudo-likelihood
+ * (unless resumed), or to start the chains from them. Otherwise, the MSA can
+ * be freed as soon as its statistics are computed.
+ */
+bool
+Sim::needsAlignment(std::string config_file, bool resume)
+{
+  std::string init = "profile";
+  std::string chains = "random";
+  if (!config_file.empty()) {
+    for (auto& setting : readConfigSection(config_file)) {
+      if (setting.first == "init") {
+        init = setting.second;
+      } else if (setting.first == "chain_init") {
+        chains = setting.second;
+      }
+    }
+  }
+  return ((init == "plm") && !resume) || (chains == "msa") ||
+         (chains == "file");
 };
 
 void
@@ -210,6 +567,42 @@ Sim::setParameter(std::string key, std::string value)
     max_step_J_N = std::stod(value);
   } else if (key == "error_min_update") {
     error_min_update = std::stod(value);
+  } else if (key == "active_set_interval") {
+    active_set_interval = std::stoi(value);
+  } else if (key == "init") {
+    init_method = value;
+  } else if (key == "plm_lambda_h") {
+    plm_lambda_h = std::stod(value);
+  } else if (key == "plm_lambda_J") {
+    plm_lambda_J = std::stod(value);
+  } else if (key == "plm_iterations") {
+    plm_iterations = std::stoi(value);
+  } else if (key == "mf_pseudocount") {
+    mf_pseudocount = std::stod(value);
+  } else if (key == "init_parameters_file") {
+    init_parameters_file = value;
+  } else if (key == "init_parameters_h_file") {
+    init_parameters_h_file = value;
+  } else if (key == "init_parameters_J_file") {
+    init_parameters_J_file = value;
+  } else if (key == "init_learning_rates_file") {
+    init_learning_rates_file = value;
+  } else if (key == "init_learning_rates_h_file") {
+    init_learning_rates_h_file = value;
+  } else if (key == "init_learning_rates_J_file") {
+    init_learning_rates_J_file = value;
+  } else if (key == "init_position_map") {
+    init_position_map = value;
+  } else if (key == "optimizer") {
+    optimizer_name = value;
+  } else if (key == "adam_beta1") {
+    adam_beta1 = std::stod(value);
+  } else if (key == "adam_beta2") {
+    adam_beta2 = std::stod(value);
+  } else if (key == "adam_epsilon") {
+    adam_epsilon = std::stod(value);
+  } else if (key == "nesterov_momentum") {
+    nesterov_momentum = std::stod(value);
   } else if (key == "t_wait_0") {
     t_wait_0 = std::stoi(value);
   } else if (key == "delta_t_0") {
@@ -224,6 +617,18 @@ Sim::setParameter(std::string key, std::string value)
     adapt_up_time = std::stod(value);
   } else if (key == "adapt_down_time") {
     adapt_down_time = std::stod(value);
+  } else if (key == "ergo_iat") {
+    if (value.size() == 1) {
+      ergo_iat = (std::stoi(value) == 1);
+    } else {
+      ergo_iat = (value == "true");
+    }
+  } else if (key == "extend_chains") {
+    if (value.size() == 1) {
+      extend_chains = (std::stoi(value) == 1);
+    } else {
+      extend_chains = (value == "true");
+    }
   } else if (key == "step_importance_max") {
     step_importance_max = std::stoi(value);
   } else if (key == "coherence_min") {
@@ -234,6 +639,8 @@ Sim::setParameter(std::string key, std::string value)
     } else {
       use_ss = (value == "true");
     }
+  } else if (key == "ss_chains") {
+    ss_chains = std::stoi(value);
   } else if (key == "M") {
     M = std::stoi(value);
   } else if (key == "count_max") {
@@ -246,6 +653,10 @@ Sim::setParameter(std::string key, std::string value)
     }
   } else if (key == "init_sample_file") {
     init_sample_file = value;
+  } else if (key == "chain_init") {
+    chain_init = value;
+  } else if (key == "chain_init_file") {
+    chain_init_file = value;
   } else if (key == "use_pos_reg") {
     if (value.size() == 1) {
       use_pos_reg = (std::stoi(value) == 1);
@@ -254,6 +665,48 @@ Sim::setParameter(std::string key, std::string value)
     }
   } else if (key == "temperature") {
     temperature = std::stod(value);
+  } else if (key == "site_order") {
+    site_order = value;
+  } else if (key == "block_pairs") {
+    block_pairs = std::stoi(value);
+  } else if (key == "block_rate") {
+    block_rate = std::stod(value);
+  } else if (key == "compress_alphabet") {
+    if (value.size() == 1) {
+      compress_alphabet = (std::stoi(value) == 1);
+    } else {
+      compress_alphabet = (value == "true");
+    }
+  } else if (key == "alphabet_min_frequency") {
+    alphabet_min_frequency = std::stod(value);
+  } else if (key == "lean_memory") {
+    if (value.size() == 1) {
+      lean_memory = (std::stoi(value) == 1);
+    } else {
+      lean_memory = (value == "true");
+    }
+  } else if (key == "sample_schedule") {
+    sample_schedule = value;
+  } else if (key == "M_min") {
+    M_min = std::stoi(value);
+  } else if (key == "sample_growth") {
+    sample_growth = std::stod(value);
+  } else if (key == "sample_error_drop") {
+    sample_error_drop = std::stod(value);
+  } else if (key == "sample_snr_min") {
+    sample_snr_min = std::stod(value);
+  } else if (key == "checkpoint_interval") {
+    checkpoint_interval = std::stoi(value);
+  } else if (key == "async_sampling") {
+    if (value.size() == 1) {
+      async_sampling = (std::stoi(value) == 1);
+    } else {
+      async_sampling = (value == "true");
+    }
+  } else if (key == "async_threads") {
+    async_threads = std::stoi(value);
+  } else if (key == "async_fresh_fraction") {
+    async_fresh_fraction = std::stod(value);
   // } else if (key == "t_wait_check") {
   //   t_wait_check = std::stoi(value);
   // } else if (key == "delta_t_check") {
@@ -275,17 +728,218 @@ Sim::setParameter(std::string key, std::string value)
 };
 
 Sim::Sim(MSAStats msa_stats, std::string config_file)
-  : msa_stats(msa_stats)
+  : msa_stats(std::move(msa_stats))
 {
-  if (config_file.empty()) {
-    initializeParameters();
-  } else {
+  // Settings missing from the config file keep their default values.
+  initializeParameters();
+  if (!config_file.empty()) {
     loadParameters(config_file);
   }
   checkParameters();
-  current_model = new Model(msa_stats, epsilon_0_h, epsilon_0_J);
-  previous_model = new Model(msa_stats, epsilon_0_h, epsilon_0_J);
-  mcmc = new MCMC(msa_stats.getN(), msa_stats.getQ());
+  if (compress_alphabet) {
+    this->msa_stats.compressAlphabet(alphabet_min_frequency);
+  }
+#ifdef USE_MPI
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  if (async_sampling && (mpi_size > 1)) {
+    std::cerr << "ERROR: 'async_sampling' cannot be used with MPI."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if ((ss_chains > 0) && (mpi_size > 1)) {
+    std::cerr << "ERROR: 'ss_chains' cannot be used with MPI." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+#endif
+
+  // Worker processes only sample, so they only need the parameters, which a
+  // lean model keeps in full.
+  current_model = new Model(this->msa_stats,
+                            epsilon_0_h,
+                            epsilon_0_J,
+                            lean_memory || (mpi_rank != 0));
+  if (lean_memory || (mpi_rank != 0)) {
+    previous_model = nullptr;
+  } else {
+    previous_model = new Model(this->msa_stats, epsilon_0_h, epsilon_0_J);
+  }
+  mcmc = new MCMC(this->msa_stats.getN(), this->msa_stats.getQ());
+  mcmc->set_site_order(site_order);
+  mcmc->set_block_updates(block_pairs, block_rate);
+
+  // Other optimizers than the default adaptive learning rates keep their own
+  // state, for the fields and the couplings.
+  optimizer = nullptr;
+  if (mpi_rank == 0) {
+    long int n_params =
+      current_model->params.h.n_elem + current_model->params.J.n_elem;
+    if (optimizer_name == "adam") {
+      optimizer =
+        new AdamOptimizer(n_params, adam_beta1, adam_beta2, adam_epsilon);
+    } else if (optimizer_name == "nesterov") {
+      optimizer = new NesterovOptimizer(n_params, nesterov_momentum);
+    }
+  }
+  printMemoryPlan();
+};
+
+/*
+ * Replace the independent-site parameters of the new models with those of an
+ * approximate inference method, if one is set with 'init'. Only the pseudo-
+ * likelihood needs the sequences of the alignment; the mean-field estimate
+ * only needs their statistics. This is skipped when resuming a run, whose
+ * models are read from the checkpoint.
+ */
+void
+Sim::initializeModel(const MSA* msa)
+{
+  if ((mpi_rank != 0) || (init_method == "profile")) {
+    return;
+  }
+
+  arma::wall_clock timer;
+  timer.tic();
+  if (init_method == "plm") {
+    if (msa == nullptr) {
+      std::cerr << "ERROR: 'init=plm' needs the sequences of the alignment, "
+                   "which are not kept with -s."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    std::cout << "initializing parameters by pseudo-likelihood "
+                 "maximization... "
+              << std::flush;
+    PseudoLikelihood plm(*msa,
+                         msa_stats.alphabet_sizes,
+                         msa_stats.alphabet_map,
+                         plm_lambda_h,
+                         plm_lambda_J);
+    plm.fit(&(current_model->params), plm_iterations);
+  } else if (init_method == "mf") {
+    std::cout << "initializing parameters by mean-field inference... "
+              << std::flush;
+    current_model->initializeMeanField(msa_stats, mf_pseudocount);
+  } else if (init_method == "parameters") {
+    std::cout << "reading initial parameters... " << std::flush;
+    int N = current_model->N;
+
+    // Each line of the position map gives a position of this alignment and
+    // the position of the initial model that it takes the parameters of.
+    // Positions that are not listed keep the independent-site fields.
+    std::vector<int> positions(N);
+    for (int i = 0; i < N; i++) {
+      positions[i] = i;
+    }
+    if (!init_position_map.empty()) {
+      std::ifstream stream(init_position_map);
+      if (!stream) {
+        std::cerr << "ERROR: couldn't open '" << init_position_map
+                  << "' for reading." << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      positions = std::vector<int>(N, -1);
+      int i, k;
+      while (stream >> i >> k) {
+        if ((i < 0) || (i >= N) || (k < 0)) {
+          std::cerr << "ERROR: invalid entry '" << i << " " << k << "' in '"
+                    << init_position_map << "'." << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        positions[i] = k;
+      }
+    }
+
+    potts_model params;
+    if (!init_parameters_file.empty()) {
+      params = loadPottsModelCompat(init_parameters_file);
+    } else {
+      params = loadPottsModel(init_parameters_h_file, init_parameters_J_file);
+    }
+    if (init_position_map.empty() && ((int)params.h.n_cols != N)) {
+      std::cerr << "ERROR: the initial model has " << params.h.n_cols
+                << " positions instead of " << N
+                << "; map them with 'init_position_map'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    current_model->importParams(params, positions);
+
+    if (!init_learning_rates_file.empty() ||
+        (!init_learning_rates_h_file.empty() &&
+         !init_learning_rates_J_file.empty())) {
+      potts_model learning_rates;
+      if (!init_learning_rates_file.empty()) {
+        learning_rates = loadPottsModelCompat(init_learning_rates_file);
+      } else {
+        learning_rates = loadPottsModel(init_learning_rates_h_file,
+                                        init_learning_rates_J_file);
+      }
+      current_model->importLearningRates(learning_rates, positions);
+      if (previous_model != nullptr) {
+        previous_model->learning_rates = current_model->learning_rates;
+      }
+    }
+  }
+  std::cout << timer.toc() << " sec" << std::endl;
+
+  if (previous_model != nullptr) {
+    previous_model->params = current_model->params;
+  }
+};
+
+/*
+ * Print the memory taken by the largest data structures of a run, which all
+ * grow as N^2 Q^2 (or N M for the samples).
+ */
+void
+Sim::printMemoryPlan(void)
+{
+  int N = msa_stats.getN();
+  int Q = msa_stats.getQ();
+  double n_pairs = N * (N - 1) / 2.;
+  double n_2p = current_model->params.J.n_elem;
+  double MB = 1024. * 1024.;
+  double tensor = n_2p * sizeof(double) / MB;
+  double models = lean_memory ? 1 : 2;
+
+  std::vector<std::pair<std::string, double>> plan;
+  plan.push_back({ "alignment 2p frequencies", tensor });
+  plan.push_back({ "parameters", models * tensor });
+  if (lean_memory) {
+    plan.push_back({ "gradient signs", n_2p * sizeof(signed char) / MB });
+    plan.push_back({ "learning rates", n_2p * sizeof(float) / MB });
+    plan.push_back({ "gauge terms", 2 * Q * n_pairs * sizeof(double) / MB });
+  } else {
+    plan.push_back({ "gradients", models * tensor });
+    plan.push_back({ "learning rates", models * tensor });
+  }
+  if (optimizer != nullptr) {
+    double n_params = current_model->params.h.n_elem + n_2p;
+    plan.push_back({ "optimizer state",
+                     optimizer->n_states * n_params * sizeof(double) / MB });
+  }
+  plan.push_back({ "mcmc 2p frequencies", tensor });
+  if (lean_memory) {
+    plan.push_back({ "mcmc 2p sigmas (only while writing)", tensor });
+  } else {
+    plan.push_back({ "mcmc 2p sigmas", tensor });
+  }
+  plan.push_back({ "sampler couplings", 2 * tensor });
+  plan.push_back(
+    { "mcmc samples", (double)M * count_max * N * sizeof(int) / MB });
+
+  double total = 0;
+  std::cout << "memory plan";
+  if (lean_memory) {
+    std::cout << " (lean)";
+  }
+  std::cout << ":" << std::endl;
+  for (auto& item : plan) {
+    std::cout << "  " << item.first << ": " << item.second << " MB"
+              << std::endl;
+    total += item.second;
+  }
+  std::cout << "  total: " << total << " MB" << std::endl;
 };
 
 Sim::~Sim(void)
@@ -294,9 +948,11 @@ Sim::~Sim(void)
   delete previous_model;
   delete mcmc;
   delete mcmc_stats;
+  delete chain_pool_stats;
+  delete optimizer;
 };
 
-void
+arma::Col<int>
 Sim::readInitialSample(int N, int Q)
 {
   std::ifstream input_stream(init_sample_file);
@@ -307,20 +963,117 @@ Sim::readInitialSample(int N, int Q)
     exit(2);
   }
 
+  arma::Col<int> sequence = arma::Col<int>(N, arma::fill::zeros);
   std::string line;
   int aa;
   std::getline(input_stream, line);
+  std::istringstream iss(line);
   for (int n = 0; n < N; n++) {
-    std::istringstream iss(line);
     iss >> aa;
     assert(aa < Q);
-    initial_sample(n) = aa;
+    sequence(n) = aa;
   }
   input_stream.close();
+  return sequence;
+};
+
+/*
+ * Set the initial sequence of each replicate, if the chains do not start from
+ * random sequences: the sequence of 'init_sample_file' for all replicates, or
+ * one sequence per replicate drawn from the alignment ('chain_init=msa', with
+ * the sequence weights) or from 'chain_init_file' ('file', uniformly), without
+ * replacement while there are enough. Sequences close to equilibrium need a
+ * much shorter burn-in than random ones. The draws only depend on
+ * 'random_seed', so that every process, and a resumed run, gets the same
+ * sequences.
+ */
+void
+Sim::initializeChains(const MSA* msa)
+{
+  int N = current_model->N;
+  int Q = current_model->Q;
+
+  arma::Mat<int> sequences;
+  if (init_sample) {
+    arma::Col<int> sequence = readInitialSample(N, Q);
+    sequences = arma::Mat<int>(N, count_max);
+    for (int rep = 0; rep < count_max; rep++) {
+      for (int i = 0; i < N; i++) {
+        sequences.at(i, rep) = sequence.at(i);
+      }
+    }
+  } else if (chain_init == "msa") {
+    if (msa == nullptr) {
+      std::cerr << "ERROR: 'chain_init=msa' needs the sequences of the "
+                   "alignment, which are not kept with -s."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    sequences = msa->sampleSequences(count_max, random_seed);
+  } else if (chain_init == "file") {
+    MSA seeds = MSA(chain_init_file, false, false);
+    if ((seeds.N != N) && (msa != nullptr) &&
+        (msa->position_map.n_elem == (arma::uword)N) &&
+        (msa->position_map.max() < seeds.N)) {
+      // Sequences of the unfiltered alignment: keep the positions of the run.
+      arma::Mat<int> alignment = arma::Mat<int>(seeds.M, N);
+      for (int m = 0; m < seeds.M; m++) {
+        for (int i = 0; i < N; i++) {
+          alignment.at(m, i) = seeds.alignment.at(m, msa->position_map.at(i));
+        }
+      }
+      seeds.alignment = alignment;
+      seeds.N = N;
+    }
+    if (seeds.N != N) {
+      std::cerr << "ERROR: the sequences of '" << chain_init_file << "' have "
+                << seeds.N << " positions instead of " << N << "."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    sequences = seeds.sampleSequences(count_max, random_seed);
+  } else {
+    return;
+  }
+
+  if (!msa_stats.alphabet_map.is_empty()) {
+    for (int rep = 0; rep < count_max; rep++) {
+      for (int i = 0; i < N; i++) {
+        sequences.at(i, rep) =
+          msa_stats.alphabet_map.at(sequences.at(i, rep), i);
+      }
+    }
+  }
+  initial_samples = sequences;
+};
+
+/*
+ * Write the initial parameters as the final ones, without training, to get
+ * coupling estimates in seconds. The mean-field initialization is used unless
+ * another one is set with 'init'.
+ */
+void
+Sim::runQuick(void)
+{
+  if (mpi_rank != 0) {
+    return;
+  }
+  if (init_method == "profile") {
+    init_method = "mf";
+    initializeModel(nullptr);
+  }
+  writeParameters("bmdca_params.conf");
+
+  if (output_binary) {
+    current_model->writeParams("parameters_h_final.bin",
+                               "parameters_J_final.bin");
+  } else {
+    current_model->writeParamsCompat("parameters_final.txt");
+  }
 };
 
 void
-Sim::run(void)
+Sim::run(bool resume)
 {
 
   std::cout << "initializing run... " << std::flush;
@@ -331,32 +1084,95 @@ Sim::run(void)
   timer.tic();
 
   int N = current_model->N;
-  int Q = current_model->Q;
 
-  // Initialize sample data structure
-  samples = arma::Cube<int>(M, N, count_max, arma::fill::zeros);
+  // With MPI, each process samples a contiguous share of the replicates.
+  // The root process (rank 0) gathers all samples, while the others only
+  // keep their own.
+  rep_first = (int)((long int)count_max * mpi_rank / mpi_size);
+  rep_last = (int)((long int)count_max * (mpi_rank + 1) / mpi_size);
+
+  // Initialize sample data structure. With a sample size schedule, chains
+  // start with fewer samples (see updateSampleSize()).
+  if (sample_schedule == "fixed") {
+    M_step = M;
+  } else {
+    M_step = Max(1, Min(M_min, M));
+  }
+  error_scheduled = -1;
+  if (mpi_rank == 0) {
+    samples = arma::Cube<int>(M_step, N, count_max, arma::fill::zeros);
+  } else {
+    samples =
+      arma::Cube<int>(M_step, N, rep_last - rep_first, arma::fill::zeros);
+  }
   mcmc_stats = new MCMCStats(&samples, &(current_model->params));
+  mcmc_stats->alphabet_map = msa_stats.alphabet_map;
+  mcmc_stats->lazy_sigma = lean_memory;
+  if (ss_chains > 0) {
+    chain_pool = arma::Cube<int>((count_max + ss_chains - 1) / ss_chains,
+                                 N,
+                                 ss_chains,
+                                 arma::fill::zeros);
+    chain_pool_stats = new MCMCStats(&chain_pool, &(current_model->params));
+  }
 
-  if (init_sample) {
-    initial_sample = arma::Col<int>(N, arma::fill::zeros);
-    readInitialSample(N, Q);
+  // Each process only keeps the initial sequences of its own replicates.
+  if (!initial_samples.is_empty() && (mpi_size > 1)) {
+    arma::Mat<int> own = arma::Mat<int>(N, rep_last - rep_first);
+    for (int rep = rep_first; rep < rep_last; rep++) {
+      for (int i = 0; i < N; i++) {
+        own.at(i, rep - rep_first) = initial_samples.at(i, rep);
+      }
+    }
+    initial_samples = own;
   }
 
-  // Instantiate the PCG random number generator and unifrom random
-  // distribution.
-  pcg32 rng(random_seed);
-  std::uniform_int_distribution<long int> dist(0, RAND_MAX - count_max);
+  // On SIGTERM (e.g. at the end of a cluster job's time limit), a checkpoint
+  // is written at the end of the current step and the run stops. On SIGUSR1,
+  // the run continues after the checkpoint. The handlers are installed on
+  // every process, since a scheduler signals all of them, and the root
+  // process collects the signals at the end of each step.
+  if (!async_sampling) {
+    std::signal(SIGTERM, handleCheckpointSignal);
+    std::signal(SIGUSR1, handleCheckpointSignal);
+  }
+
+  if (mpi_rank != 0) {
+    runWorker();
+    return;
+  }
 
-  // Initialize the buffer.
-  run_buffer = arma::Mat<double>(save_parameters, 19, arma::fill::zeros);
-  initializeRunLog();
+  // Initialize the buffer. A resumed run appends to its log.
+  run_buffer = arma::Mat<double>(save_parameters, 25, arma::fill::zeros);
+  if (!resume) {
+    initializeRunLog();
+  }
 
   std::cout << timer.toc() << " sec" << std::endl << std::endl;
 
-  // BM sampling loop
+  if (async_sampling) {
+    if (resume) {
+      std::cerr << "ERROR: runs with 'async_sampling' cannot be resumed."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    runAsync();
+    return;
+  }
+
   int t_wait = t_wait_0;
   int delta_t = delta_t_0;
-  for (step = 1; step <= step_max; step++) {
+  int first_step = 1;
+  if (resume) {
+    std::cout << "reading checkpoint... " << std::flush;
+    timer.tic();
+    first_step = readCheckpoint(&t_wait, &delta_t) + 1;
+    std::cout << timer.toc() << " sec" << std::endl;
+    std::cout << "resuming at step " << first_step << std::endl << std::endl;
+  }
+
+  // BM sampling loop
+  for (step = first_step; step <= step_max; step++) {
     step_timer.tic();
     std::cout << "Step: " << step << std::endl;
 
@@ -364,43 +1180,139 @@ Sim::run(void)
     run_buffer.at((step - 1) % save_parameters, 1) = count_max;
     run_buffer.at((step - 1) % save_parameters, 2) = t_wait;
     run_buffer.at((step - 1) % save_parameters, 3) = delta_t;
+    run_buffer.at((step - 1) % save_parameters, 21) = M_step;
 
     std::cout << "loading params to mcmc... " << std::flush;
     timer.tic();
-    mcmc->load(current_model->params);
+    loadSampler();
     std::cout << timer.toc() << " sec" << std::endl;
 
     // Sampling from MCMC (keep trying until correct properties found)
     bool flag_mc = true;
+    bool extend = false;
+    int attempt = 0;
     while (flag_mc) {
       // Draw from MCMC
-      std::cout << "sampling model with mcmc... " << std::flush;
+      if (extend) {
+        std::cout << "extending mcmc chains... " << std::flush;
+      } else {
+        std::cout << "sampling model with mcmc... " << std::flush;
+      }
       timer.tic();
-      long int seed = dist(rng);
+      long int seed = deriveSeed(random_seed, step, attempt++);
       run_buffer.at((step - 1) % save_parameters, 17) = seed;
-      if (init_sample) {
-        mcmc->sample_init(&samples,
-                          count_max,
-                          M,
-                          N,
-                          t_wait,
-                          delta_t,
-                          &initial_sample,
-                          seed,
-                          temperature);
+      if (ss_chains > 0) {
+        sampleChainPool(t_wait, delta_t, seed);
       } else {
-        mcmc->sample(
-          &samples, count_max, M, N, t_wait, delta_t, dist(rng), temperature);
+        sampleChains(t_wait, delta_t, seed, extend);
       }
       std::cout << timer.toc() << " sec" << std::endl;
 
       std::cout << "updating mcmc with samples... " << std::flush;
       timer.tic();
-      mcmc_stats->updateData(&samples, &(current_model->params));
+      if (check_ergo || (step_importance_max > 1) ||
+          (step % save_parameters == 0) || (step == step_max)) {
+        gatherSamples();
+      }
+      mcmc_stats->updateData(
+        &samples, &(current_model->params), samples_gathered);
       std::cout << timer.toc() << " sec" << std::endl;
 
       // Run checks and alter burn-in and wait times
-      if (check_ergo) {
+      if (ss_chains > 0) {
+        // Persistent chains continue at the next step, after a burn-in only
+        // for the samples that were not equilibrated. More than a tenth of
+        // them are drawn again.
+        int delta_t_sampled = delta_t;
+        t_wait = 0;
+        flag_mc = false;
+        if (check_ergo) {
+          std::cout << "computing autocorrelation times... " << std::flush;
+          timer.tic();
+          chain_pool_stats->updateData(&chain_pool,
+                                       &(current_model->params));
+          chain_pool_stats->computeAutocorrelationTimes();
+          std::cout << timer.toc() << " sec" << std::endl;
+
+          std::vector<double> iat_stats =
+            chain_pool_stats->getAutocorrelationStats();
+
+          double tau = iat_stats.at(0);
+          double burn_in = iat_stats.at(3);
+
+          run_buffer.at((step - 1) % save_parameters, 22) = tau;
+          run_buffer.at((step - 1) % save_parameters, 23) = iat_stats.at(1);
+          run_buffer.at((step - 1) % save_parameters, 24) = burn_in;
+
+          std::cout << "autocorrelation time " << tau
+                    << ", effective samples " << iat_stats.at(1) << " (min "
+                    << iat_stats.at(2) << " per chain)" << std::endl;
+
+          if (tau > IAT_INCREASE) {
+            delta_t = (int)(ceil((double)delta_t * tau));
+            std::cout << "increasing wait time to " << delta_t << std::endl;
+          } else if (tau < IAT_DECREASE) {
+            delta_t = Max((int)(round((double)delta_t * adapt_down_time)), 1);
+            std::cout << "decreasing wait time to " << delta_t << std::endl;
+          }
+          if (burn_in >= 1) {
+            t_wait = (int)(ceil(burn_in * delta_t_sampled));
+            std::cout << "burn-in of " << t_wait << " before the next samples"
+                      << std::endl;
+          }
+          if (burn_in > 0.1 * chain_pool.n_rows) {
+            std::cout << "resampling..." << std::endl;
+            flag_mc = true;
+          }
+        }
+      } else if (check_ergo && ergo_iat) {
+        std::cout << "computing autocorrelation times... " << std::flush;
+        timer.tic();
+        mcmc_stats->computeAutocorrelationTimes();
+        std::cout << timer.toc() << " sec" << std::endl;
+
+        std::vector<double> iat_stats = mcmc_stats->getAutocorrelationStats();
+
+        double tau = iat_stats.at(0);
+        double ess = iat_stats.at(1);
+        double burn_in = iat_stats.at(3);
+
+        run_buffer.at((step - 1) % save_parameters, 22) = tau;
+        run_buffer.at((step - 1) % save_parameters, 23) = ess;
+        run_buffer.at((step - 1) % save_parameters, 24) = burn_in;
+
+        std::cout << "autocorrelation time " << tau << ", effective samples "
+                  << ess << " (min " << iat_stats.at(2) << " per chain)"
+                  << std::endl;
+
+        // Thin to about one autocorrelation time between samples, and extend
+        // the burn-in by the time spent on samples that were not yet
+        // equilibrated (below one sample on average, the burn-in is probed
+        // downward). The sample is kept unless they are over a tenth of it.
+        int delta_t_sampled = delta_t;
+        if (tau > IAT_INCREASE) {
+          delta_t = (int)(ceil((double)delta_t * tau));
+          std::cout << "increasing wait time to " << delta_t << std::endl;
+        } else if (tau < IAT_DECREASE) {
+          delta_t = Max((int)(round((double)delta_t * adapt_down_time)), 1);
+          std::cout << "decreasing wait time to " << delta_t << std::endl;
+        }
+
+        if (burn_in >= 1) {
+          t_wait = t_wait + (int)(ceil(burn_in * delta_t_sampled));
+          std::cout << "increasing burn-in time to " << t_wait << std::endl;
+        } else {
+          t_wait = Max((int)(round((double)t_wait * adapt_down_time)), 1);
+          std::cout << "decreasing burn-in time to " << t_wait << std::endl;
+        }
+
+        if (burn_in > 0.1 * M_step) {
+          std::cout << "resampling..." << std::endl;
+          extend = extend_chains;
+        } else {
+          flag_mc = false;
+        }
+      } else if (check_ergo) {
         std::cout << "computing sequence energies and correlations... "
                   << std::flush;
         timer.tic();
@@ -474,6 +1386,7 @@ Sim::run(void)
           flag_mc = false;
         } else {
           std::cout << "resampling..." << std::endl;
+          extend = extend_chains;
         }
       } else {
         flag_mc = false;
@@ -502,351 +1415,958 @@ Sim::run(void)
       } else {
         std::cout << "computing mcmc 1p and 2p statistics... " << std::flush;
         timer.tic();
-        mcmc_stats->computeSampleStats();
+        computeSampleStats();
         std::cout << timer.toc() << " sec" << std::endl;
       }
 
-      // Compute error reparametrization
-      previous_model->gradient.h = current_model->gradient.h;
-      previous_model->gradient.J = current_model->gradient.J;
-
-      std::cout << "computing error and updating gradient... " << std::flush;
+      // Compute the gradient and update the learning rates and parameters.
+      // The new model is written to previous_model, and the two are swapped
+      // (in lean mode, the current model is updated in place).
+      std::cout << "updating parameters... " << std::flush;
       timer.tic();
-      bool converged = computeErrorReparametrization();
+      bool converged = updateModel();
       std::cout << timer.toc() << " sec" << std::endl;
 
       if (converged) {
         std::cout << "writing results" << std::endl;
+        if (!lean_memory) {
+          current_model->gradient = previous_model->gradient;
+        }
+        if (gatherSamples()) {
+          mcmc_stats->computeEnergies();
+        }
         writeData("final");
         writeRunLog(step % save_parameters);
+        stopWorkers();
         return;
       }
-
-      // Update learning rate
-      previous_model->learning_rates.h = current_model->learning_rates.h;
-      previous_model->learning_rates.J = current_model->learning_rates.J;
-      std::cout << "update learning rate... " << std::flush;
-      timer.tic();
-      updateLearningRate();
-      std::cout << timer.toc() << " sec" << std::endl;
+      if (!lean_memory) {
+        std::swap(current_model, previous_model);
+      }
 
       run_buffer.at((step - 1) % save_parameters, 18) = step_timer.toc();
 
-      // Save parameters
+      // Save parameters (from before the update, except in lean mode) with the
+      // new gradient and learning rates.
       // if ((step % save_parameters == 0 || step == 1) &&
       if (step % save_parameters == 0 &&
           (step_importance == step_importance_max || flag_coherence == false)) {
         std::cout << "writing step " << step << "... " << std::flush;
         timer.tic();
-        writeData(std::to_string(step));
+        writeData(std::to_string(step), previous_model);
         writeRunLog(step % save_parameters);
         std::cout << timer.toc() << " sec" << std::endl;
       }
+    }
 
-      // Update parameters
-      previous_model->params.h = current_model->params.h;
-      previous_model->params.J = current_model->params.J;
-      std::cout << "updating parameters... " << std::flush;
+    // The last step is followed by the final results, so it needs no
+    // checkpoint.
+    int received = collectSignal();
+    if ((step < step_max) &&
+        (((checkpoint_interval > 0) && (step % checkpoint_interval == 0)) ||
+         (received != 0))) {
+      std::cout << "writing checkpoint... " << std::flush;
       timer.tic();
-      updateReparameterization();
+      writeCheckpoint(t_wait, delta_t);
       std::cout << timer.toc() << " sec" << std::endl;
+      if (received == SIGTERM) {
+        std::cout << "stopping at step " << step << " (SIGTERM)" << std::endl;
+        stopWorkers();
+        return;
+      }
     }
     std::cout << std::endl;
   }
   std::cout << "writing final results... " << std::flush;
+  if (gatherSamples()) {
+    mcmc_stats->computeEnergies();
+  }
   writeData("final");
   std::cout << "done" << std::endl;
+  stopWorkers();
   return;
 };
 
-bool
-Sim::computeErrorReparametrization(void)
+/*
+ * Asynchronous BM loop. Sampler threads (see runSampler()) draw chains from
+ * the latest published snapshot of the parameters into a shared pool, while
+ * this thread updates the model as soon as enough chains have been resampled
+ * since the previous update, so neither side waits for the other to finish.
+ * The staleness of a chain is the number of updates made since the snapshot
+ * it was sampled from was published.
+ */
+void
+Sim::runAsync(void)
 {
-  double M_eff = msa_stats.getEffectiveM();
-  int N = msa_stats.getN();
-  int M = msa_stats.getM();
-  int Q = msa_stats.getQ();
+  arma::wall_clock step_timer;
+  arma::wall_clock timer;
 
-  double error_stat_1p = 0;
-  double error_stat_2p = 0;
-  double error_stat_tot = 0;
-  double error_1p = 0;
-  double error_2p = 0;
-  double error_tot = 0;
-  double delta;
-  double delta_stat = 0;
-  double deltamax_1 = 0;
-  double deltamax_2 = 0;
-  double rho = 0, beta = 0, den_beta = 0, num_beta = 0, num_rho = 0,
-         den_stat = 0, den_mc = 0, c_mc_av = 0, c_stat_av = 0, rho_1p = 0,
-         num_rho_1p = 0, den_stat_1p = 0, den_mc_1p = 0;
+  int N = current_model->N;
 
-  double lambda_h = lambda_reg1;
-  double lambda_j = lambda_reg2;
+  int n_threads = async_threads;
+  if (n_threads <= 0) {
+    n_threads = Max((int)std::thread::hardware_concurrency() - 1, 1);
+  }
+  n_threads = Min(n_threads, count_max);
+  int fresh_min = Max((int)ceil(async_fresh_fraction * count_max), 1);
+
+  // Snapshots are double-buffered: the learner loads new parameters into the
+  // buffer that is not published, once no sampler is reading it anymore.
+  snapshots[0] = mcmc;
+  snapshots[1] = new MCMC(msa_stats.getN(), msa_stats.getQ());
+  snapshots[1]->set_site_order(site_order);
+  snapshots[1]->set_block_updates(block_pairs, block_rate);
+  snapshots[0]->load(current_model->params);
+  snapshot_version[0] = 0;
+  snapshot_version[1] = 0;
+  snapshot_readers[0] = 0;
+  snapshot_readers[1] = 0;
+  snapshot_published = 0;
+  bool publish_pending = false;
+
+  sample_pool = arma::Cube<int>(M, N, count_max, arma::fill::zeros);
+  pool_version = std::vector<long int>(count_max, -1);
+  pool_filled = 0;
+  pool_fresh = 0;
+  stop_samplers = false;
+
+  std::cout << "starting " << n_threads << " sampler threads, updating after "
+            << fresh_min << " new chains" << std::endl
+            << std::endl;
+  for (int thread = 0; thread < n_threads; thread++) {
+    samplers.emplace_back(&Sim::runSampler, this, thread, n_threads);
+  }
 
-  int count1 = 0;
-  int count2 = 0;
+  for (step = 1; step <= step_max; step++) {
+    step_timer.tic();
+    std::cout << "Step: " << step << std::endl;
 
-  // Compute gradient
-  for (int i = 0; i < N; i++) {
-    for (int aa = 0; aa < Q; aa++) {
-      delta = mcmc_stats->frequency_1p.at(aa, i) -
-              msa_stats.frequency_1p.at(aa, i) +
-              lambda_h * current_model->params.h.at(aa, i);
-      delta_stat =
-        (mcmc_stats->frequency_1p.at(aa, i) -
-         msa_stats.frequency_1p.at(aa, i)) /
-        (pow(msa_stats.frequency_1p.at(aa, i) *
-                 (1. - msa_stats.frequency_1p.at(aa, i)) / M_eff +
-               pow(mcmc_stats->frequency_1p_sigma.at(aa, i), 2) + EPSILON,
-             0.5));
-      error_1p += pow(delta, 2);
-      error_stat_1p += pow(delta_stat, 2);
-      if (pow(delta, 2) > pow(deltamax_1, 2))
-        deltamax_1 = sqrt(pow(delta, 2));
+    run_buffer.at((step - 1) % save_parameters, 0) = step;
+    run_buffer.at((step - 1) % save_parameters, 1) = count_max;
+    run_buffer.at((step - 1) % save_parameters, 2) = t_wait_0;
+    run_buffer.at((step - 1) % save_parameters, 3) = delta_t_0;
 
-      if (sqrt(pow(delta_stat, 2)) > error_min_update) {
-        current_model->gradient.h.at(aa, i) = -delta;
-        count1++;
+    std::cout << "waiting for new chains... " << std::flush;
+    timer.tic();
+    double staleness_avg = 0;
+    int staleness_max = 0;
+    {
+      std::unique_lock<std::mutex> lock(pool_mutex);
+      while ((pool_filled < count_max) || (pool_fresh < fresh_min)) {
+        // Retry publishing the parameters while waiting, as the samplers
+        // release the old snapshot after each chain.
+        if (publish_pending) {
+          lock.unlock();
+          publish_pending = !publishSnapshot(step - 1);
+          lock.lock();
+        }
+        pool_ready.wait_for(lock, std::chrono::milliseconds(1));
       }
+      samples = sample_pool;
+      for (int rep = 0; rep < count_max; rep++) {
+        int staleness = (int)(step - 1 - pool_version.at(rep));
+        staleness_avg += (double)staleness / count_max;
+        staleness_max = (int)Max(staleness_max, staleness);
+      }
+      pool_fresh = 0;
     }
-  }
+    std::cout << timer.toc() << " sec" << std::endl;
+    std::cout << "staleness: " << staleness_avg << " avg, " << staleness_max
+              << " max" << std::endl;
+    run_buffer.at((step - 1) % save_parameters, 19) = staleness_avg;
+    run_buffer.at((step - 1) % save_parameters, 20) = staleness_max;
 
-  double error_c = 0;
-  double c_mc = 0, c_stat = 0;
+    std::cout << "updating mcmc with samples... " << std::flush;
+    timer.tic();
+    mcmc_stats->updateData(&samples, &(current_model->params));
+    std::cout << timer.toc() << " sec" << std::endl;
 
-  for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      for (int aa1 = 0; aa1 < Q; aa1++) {
-        for (int aa2 = 0; aa2 < Q; aa2++) {
-          if (use_pos_reg) {
-            delta =
-              -(msa_stats.frequency_2p.at(i, j).at(aa1, aa2) -
-                mcmc_stats->frequency_2p.at(i, j).at(aa1, aa2) +
-                (mcmc_stats->frequency_1p.at(aa1, i) -
-                 msa_stats.frequency_1p.at(aa1, i)) *
-                  msa_stats.frequency_1p.at(aa2, j) +
-                (mcmc_stats->frequency_1p.at(aa2, j) -
-                 msa_stats.frequency_1p.at(aa2, j)) *
-                  msa_stats.frequency_1p.at(aa1, i) -
-                lambda_j * current_model->params.J.at(i, j).at(aa1, aa2) * 1. /
-                  (1. + fabs(msa_stats.rel_entropy_grad_1p(aa1, i))) /
-                  (1. + fabs(msa_stats.rel_entropy_grad_1p(aa2, j))));
-          } else {
-            delta = -(msa_stats.frequency_2p.at(i, j).at(aa1, aa2) -
-                      mcmc_stats->frequency_2p.at(i, j).at(aa1, aa2) +
-                      (mcmc_stats->frequency_1p.at(aa1, i) -
-                       msa_stats.frequency_1p.at(aa1, i)) *
-                        msa_stats.frequency_1p.at(aa2, j) +
-                      (mcmc_stats->frequency_1p.at(aa2, j) -
-                       msa_stats.frequency_1p.at(aa2, j)) *
-                        msa_stats.frequency_1p.at(aa1, i) -
-                      lambda_j * current_model->params.J.at(i, j).at(aa1, aa2));
-          }
-          delta_stat =
-            (mcmc_stats->frequency_2p.at(i, j).at(aa1, aa2) -
-             msa_stats.frequency_2p.at(i, j).at(aa1, aa2)) /
-            (pow(msa_stats.frequency_2p.at(i, j).at(aa1, aa2) *
-                     (1.0 - msa_stats.frequency_2p.at(i, j).at(aa1, aa2)) /
-                     M_eff +
-                   pow(mcmc_stats->frequency_2p.at(i, j).at(aa1, aa2), 2) +
-                   EPSILON,
-                 0.5));
-
-          c_mc = mcmc_stats->frequency_2p.at(i, j).at(aa1, aa2) -
-                 mcmc_stats->frequency_1p.at(aa1, i) *
-                   mcmc_stats->frequency_1p.at(aa2, j);
-          c_stat = msa_stats.frequency_2p.at(i, j).at(aa1, aa2) -
-                   msa_stats.frequency_1p.at(aa1, i) *
-                     msa_stats.frequency_1p.at(aa2, j);
-          c_mc_av += c_mc;
-          c_stat_av += c_stat;
-          error_c += pow(c_mc - c_stat, 2);
-          error_2p += pow(delta, 2);
-          error_stat_2p += pow(delta_stat, 2);
-
-          if (pow(delta, 2) > pow(deltamax_2, 2)) {
-            deltamax_2 = sqrt(pow(delta, 2));
-          }
-          if (sqrt(pow(delta_stat, 2)) > error_min_update) {
-            current_model->gradient.J.at(i, j).at(aa1, aa2) = -delta;
-            count2++;
-          }
-        }
+    std::cout << "computing mcmc 1p and 2p statistics... " << std::flush;
+    timer.tic();
+    computeSampleStats();
+    std::cout << timer.toc() << " sec" << std::endl;
+
+    std::cout << "updating parameters... " << std::flush;
+    timer.tic();
+    bool converged = updateModel();
+    std::cout << timer.toc() << " sec" << std::endl;
+
+    if (converged) {
+      std::cout << "writing results" << std::endl;
+      stopSamplers();
+      if (!lean_memory) {
+        current_model->gradient = previous_model->gradient;
       }
+      writeData("final");
+      writeRunLog(step % save_parameters);
+      return;
+    }
+    if (!lean_memory) {
+      std::swap(current_model, previous_model);
+    }
+    publish_pending = !publishSnapshot(step);
+
+    run_buffer.at((step - 1) % save_parameters, 18) = step_timer.toc();
+
+    if (step % save_parameters == 0) {
+      std::cout << "writing step " << step << "... " << std::flush;
+      timer.tic();
+      writeData(std::to_string(step), previous_model);
+      writeRunLog(step % save_parameters);
+      std::cout << timer.toc() << " sec" << std::endl;
     }
+    std::cout << std::endl;
   }
+  stopSamplers();
+  std::cout << "writing final results... " << std::flush;
+  writeData("final");
+  std::cout << "done" << std::endl;
+  return;
+};
 
-  c_stat_av /= ((N * (N - 1) * Q * Q) / 2);
-  c_mc_av /= ((N * (N - 1) * Q * Q) / 2);
+/*
+ * Loop of a sampler thread: draw chains from the latest published snapshot,
+ * and store them in the pool, cycling over the pool slots thread, thread +
+ * n_threads, ... until the learner stops. Each slot's chain continues from the
+ * last sample it stored.
+ */
+void
+Sim::runSampler(int thread, int n_threads)
+{
+  int N = current_model->N;
 
-  num_rho = num_beta = den_stat = den_mc = den_beta = 0;
-  for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      for (int aa1 = 0; aa1 < Q; aa1++) {
-        for (int aa2 = 0; aa2 < Q; aa2++) {
-          c_mc = mcmc_stats->frequency_2p.at(i, j).at(aa1, aa2) -
-                 mcmc_stats->frequency_1p.at(aa1, i) *
-                   mcmc_stats->frequency_1p.at(aa2, j);
-          c_stat = msa_stats.frequency_2p.at(i, j).at(aa1, aa2) -
-                   msa_stats.frequency_1p.at(aa1, i) *
-                     msa_stats.frequency_1p.at(aa2, j);
-          num_rho += (c_mc - c_mc_av) * (c_stat - c_stat_av);
-          num_beta += (c_mc) * (c_stat);
-          den_stat += pow(c_stat - c_stat_av, 2);
-          den_mc += pow(c_mc - c_mc_av, 2);
-          den_beta += pow(c_stat, 2);
-        }
+  pcg32 rng(random_seed + thread);
+  std::uniform_int_distribution<long int> dist(0, RAND_MAX);
+
+  arma::Mat<int> chain = arma::Mat<int>(M, N, arma::fill::zeros);
+  arma::Col<int> init = arma::Col<int>(N, arma::fill::zeros);
+  int slot = thread;
+  while (!stop_samplers) {
+    // Pin the published snapshot. If it was replaced in the meantime, the
+    // learner may already be writing to it, so try again.
+    int buffer;
+    while (true) {
+      buffer = snapshot_published;
+      snapshot_readers[buffer]++;
+      if (buffer == snapshot_published) {
+        break;
       }
+      snapshot_readers[buffer]--;
     }
-  }
+    long int version = snapshot_version[buffer];
+    // Only this thread writes to its slots, so they are read without the lock.
+    arma::Col<int>* init_ptr = nullptr;
+    if (pool_version.at(slot) >= 0) {
+      for (int i = 0; i < N; i++) {
+        init.at(i) = sample_pool.at(M - 1, i, slot);
+      }
+      init_ptr = &init;
+    } else if (!initial_samples.is_empty()) {
+      init = initial_samples.col(slot);
+      init_ptr = &init;
+    }
+    snapshots[buffer]->sample_chain(&chain,
+                                    M,
+                                    t_wait_0,
+                                    delta_t_0,
+                                    init_ptr,
+                                    dist(rng),
+                                    slot,
+                                    temperature);
+    snapshot_readers[buffer]--;
+
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      sample_pool.slice(slot) = chain;
+      if (pool_version.at(slot) < 0) {
+        pool_filled++;
+      }
+      pool_version.at(slot) = version;
+      pool_fresh++;
+    }
+    pool_ready.notify_one();
 
-  num_rho_1p = den_stat_1p = den_mc_1p = 0;
-  for (int i = 0; i < N; i++) {
-    for (int aa = 0; aa < Q; aa++) {
-      num_rho_1p += (mcmc_stats->frequency_1p.at(aa, i) - 1.0 / Q) *
-                    (msa_stats.frequency_1p.at(aa, i) - 1.0 / Q);
-      den_stat_1p += pow(msa_stats.frequency_1p.at(aa, i) - 1.0 / Q, 2);
-      den_mc_1p += pow(mcmc_stats->frequency_1p.at(aa, i) - 1.0 / Q, 2);
+    slot += n_threads;
+    if (slot >= count_max) {
+      slot = thread;
     }
   }
+};
+
+/*
+ * Load the current parameters into the snapshot that is not published, and
+ * publish it. Returns false, without waiting, if samplers are still reading
+ * that snapshot.
+ */
+bool
+Sim::publishSnapshot(long int version)
+{
+  int buffer = 1 - snapshot_published;
+  if (snapshot_readers[buffer] > 0) {
+    return false;
+  }
+  snapshots[buffer]->load(current_model->params);
+  snapshot_version[buffer] = version;
+  snapshot_published = buffer;
+  return true;
+};
 
-  beta = num_beta / den_beta;
-  rho = num_rho / sqrt(den_mc * den_stat);
-  rho_1p = num_rho_1p / sqrt(den_mc_1p * den_stat_1p);
+void
+Sim::stopSamplers(void)
+{
+  stop_samplers = true;
+  for (auto& sampler : samplers) {
+    sampler.join();
+  }
+  samplers.clear();
+  delete snapshots[1];
+  snapshots[1] = nullptr;
+};
 
-  error_1p = sqrt(error_1p / (N * Q));
-  error_2p = sqrt(error_2p / ((N * (N - 1) * Q * Q) / 2));
+/*
+ * Load the current parameters into the sampler. With MPI, the root process
+ * first sends its parameters to the workers.
+ */
+void
+Sim::loadSampler(void)
+{
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    if (mpi_rank == 0) {
+      sendCommand(COMMAND_LOAD_PARAMS);
+    }
+    potts_model& params = current_model->params;
+    broadcastArray(params.h.memptr(), params.h.n_elem);
+    broadcastArray(params.J.memptr(), params.J.n_elem);
+  }
+#endif
+  mcmc->load(current_model->params);
+};
 
-  error_stat_1p = sqrt(error_stat_1p / (N * Q));
-  error_stat_2p = sqrt(error_stat_2p / (N * (N - 1) * Q * Q) / 2);
+/*
+ * Sample the replicates of this process, which are the first slices of
+ * 'samples'. Replicate r always draws from PCG stream r of seed, so that the
+ * samples do not depend on the number of processes. With 'extend', the chains
+ * of the previous call are continued instead (see MCMC::extend). With MPI, the
+ * root process sends the sampling settings to the workers, which keep their
+ * samples until they are gathered (see gatherSamples()).
+ */
+void
+Sim::sampleChains(int t_wait, int delta_t, long int seed, bool extend)
+{
+  int N = current_model->N;
 
-  error_c = sqrt(error_c / (N * (N - 1) * Q * Q) / 2);
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    if (mpi_rank == 0) {
+      sendCommand(COMMAND_SAMPLE);
+    }
+    long int settings[5] = { t_wait, delta_t, seed, M_step, extend };
+    MPI_Bcast(settings, 5, MPI_LONG, 0, MPI_COMM_WORLD);
+    t_wait = settings[0];
+    delta_t = settings[1];
+    seed = settings[2];
+    M_step = settings[3];
+    extend = (settings[4] == 1);
+  }
+#endif
 
-  error_tot = error_1p + error_2p;
-  error_stat_tot = error_stat_1p + error_stat_2p;
+  int reps = rep_last - rep_first;
+  if ((int)samples.n_rows != M_step) {
+    samples = arma::Cube<int>(M_step, N, samples.n_slices, arma::fill::zeros);
+    extend = false;
+  }
+  if (extend) {
+    mcmc->extend(&samples,
+                 reps,
+                 M_step,
+                 t_wait,
+                 delta_t,
+                 &sample_times,
+                 seed,
+                 rep_first,
+                 temperature);
+  } else if (!initial_samples.is_empty()) {
+    mcmc->sample_init(&samples,
+                      reps,
+                      M_step,
+                      N,
+                      t_wait,
+                      delta_t,
+                      &initial_samples,
+                      seed,
+                      rep_first,
+                      temperature);
+  } else {
+    mcmc->sample(&samples,
+                 reps,
+                 M_step,
+                 N,
+                 t_wait,
+                 delta_t,
+                 seed,
+                 rep_first,
+                 temperature);
+  }
+  if (!extend) {
+    sample_times = std::vector<long int>(M_step);
+    for (int s = 0; s < M_step; s++) {
+      sample_times[s] = (long int)t_wait + (long int)(s + 1) * delta_t;
+    }
+  }
 
-  run_buffer.at((step - 1) % save_parameters, 14) = error_1p;
-  run_buffer.at((step - 1) % save_parameters, 15) = error_2p;
-  run_buffer.at((step - 1) % save_parameters, 16) = error_tot;
+  samples_gathered = (mpi_size == 1);
+};
 
-  bool converged = false;
-  if (error_tot < error_max) {
-    std::cout << "converged" << std::endl;
-    converged = true;
+/*
+ * With MPI, gather the samples of the last call to sampleChains() on the root
+ * process, and return whether any had to be. The root process only needs them
+ * to check the chains, for importance sampling and to write them, as the
+ * statistics are reduced from the counts of each process (see
+ * computeSampleStats()).
+ */
+bool
+Sim::gatherSamples(void)
+{
+#ifdef USE_MPI
+  if ((mpi_size > 1) && !samples_gathered) {
+    if (mpi_rank == 0) {
+      sendCommand(COMMAND_GATHER);
+    }
+    int N = current_model->N;
+    int reps = rep_last - rep_first;
+    int slice_size = M_step * N;
+    if (mpi_rank == 0) {
+      std::vector<int> counts(mpi_size);
+      std::vector<int> offsets(mpi_size);
+      for (int rank = 0; rank < mpi_size; rank++) {
+        int first = (int)((long int)count_max * rank / mpi_size);
+        int last = (int)((long int)count_max * (rank + 1) / mpi_size);
+        counts[rank] = (last - first) * slice_size;
+        offsets[rank] = first * slice_size;
+      }
+      MPI_Gatherv(MPI_IN_PLACE,
+                  0,
+                  MPI_INT,
+                  samples.memptr(),
+                  counts.data(),
+                  offsets.data(),
+                  MPI_INT,
+                  0,
+                  MPI_COMM_WORLD);
+    } else {
+      MPI_Gatherv(samples.memptr(),
+                  reps * slice_size,
+                  MPI_INT,
+                  nullptr,
+                  nullptr,
+                  nullptr,
+                  MPI_INT,
+                  0,
+                  MPI_COMM_WORLD);
+    }
+    samples_gathered = true;
+    return true;
   }
-  return converged;
+#endif
+  return false;
 };
 
+/*
+ * Sample with the persistent chains of 'ss_chains' (with use_ss). Instead of
+ * count_max chains that each pay the whole burn-in for a single sample, each
+ * chain emits count_max / ss_chains samples delta_t steps apart, and continues
+ * at the next step from where it stopped, after t_wait more steps. Sample r of
+ * chain c is replicate r * ss_chains + c, so the samples keep the shape of
+ * use_ss (count_max replicates of one sample).
+ */
 void
-Sim::updateLearningRate(void)
+Sim::sampleChainPool(int t_wait, int delta_t, long int seed)
 {
-  double M_eff = msa_stats.getEffectiveM();
-  int N = msa_stats.getN();
-  int M = msa_stats.getM();
-  int Q = msa_stats.getQ();
-  double max_step_J = max_step_J_N / N;
+  int N = current_model->N;
+  int chain_length = chain_pool.n_rows;
+
+  if (!chain_pool_started) {
+    if (!initial_samples.is_empty()) {
+      mcmc->sample_init(&chain_pool,
+                        ss_chains,
+                        chain_length,
+                        N,
+                        t_wait,
+                        delta_t,
+                        &initial_samples,
+                        seed,
+                        0,
+                        temperature);
+    } else {
+      mcmc->sample(&chain_pool,
+                   ss_chains,
+                   chain_length,
+                   N,
+                   t_wait,
+                   delta_t,
+                   seed,
+                   0,
+                   temperature);
+    }
+    chain_pool_started = true;
+  } else {
+    mcmc->sample_continue(
+      &chain_pool, ss_chains, t_wait, delta_t, seed, 0, temperature);
+  }
 
-  double alfa = 0;
-  for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      for (int a = 0; a < Q; a++) {
-        for (int b = 0; b < Q; b++) {
-          alfa = Theta(current_model->gradient.J.at(i, j).at(a, b) *
-                       previous_model->gradient.J.at(i, j).at(a, b)) *
-                   adapt_up +
-                 Theta(-current_model->gradient.J.at(i, j).at(a, b) *
-                       previous_model->gradient.J.at(i, j).at(a, b)) *
-                   adapt_down +
-                 Delta(current_model->gradient.J.at(i, j).at(a, b) *
-                       previous_model->gradient.J.at(i, j).at(a, b));
-
-          current_model->learning_rates.J.at(i, j).at(a, b) =
-            Min(max_step_J,
-                Max(min_step_J,
-                    alfa * current_model->learning_rates.J.at(i, j).at(a, b)));
+  for (int r = 0; r < chain_length; r++) {
+    for (int c = 0; c < ss_chains; c++) {
+      int rep = r * ss_chains + c;
+      if (rep < count_max) {
+        for (int i = 0; i < N; i++) {
+          samples.at(0, i, rep) = chain_pool.at(r, i, c);
         }
       }
     }
   }
+};
 
-  for (int i = 0; i < N; i++) {
-    for (int a = 0; a < Q; a++) {
-      alfa = Theta(current_model->gradient.h.at(a, i) *
-                   previous_model->gradient.h.at(a, i)) *
-               adapt_up +
-             Theta(-current_model->gradient.h.at(a, i) *
-                   previous_model->gradient.h.at(a, i)) *
-               adapt_down +
-             Delta(current_model->gradient.h.at(a, i) *
-                   previous_model->gradient.h.at(a, i));
-      current_model->learning_rates.h.at(a, i) =
-        Min(max_step_h,
-            Max(min_step_h, alfa * current_model->learning_rates.h.at(a, i)));
+/*
+ * Compute the 1p and 2p statistics of the samples. With MPI, each process
+ * counts its own replicates, and only the counts are summed on the root
+ * process.
+ */
+void
+Sim::computeSampleStats(void)
+{
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    if (mpi_rank == 0) {
+      sendCommand(COMMAND_COUNT);
+    }
+    mcmc_stats->accumulateSampleCounts(0, rep_last - rep_first);
+    reduceArray(mcmc_stats->frequency_1p.memptr(),
+                mcmc_stats->frequency_1p.n_elem,
+                mpi_rank);
+    reduceArray(mcmc_stats->frequency_1p_sigma.memptr(),
+                mcmc_stats->frequency_1p_sigma.n_elem,
+                mpi_rank);
+    reduceArray(mcmc_stats->frequency_2p.memptr(),
+                mcmc_stats->frequency_2p.n_elem,
+                mpi_rank);
+    reduceArray(mcmc_stats->frequency_2p_sigma.memptr(),
+                mcmc_stats->frequency_2p_sigma.n_elem,
+                mpi_rank);
+    if (mpi_rank == 0) {
+      mcmc_stats->finalizeSampleStats(count_max);
     }
+    return;
   }
+#endif
+  mcmc_stats->computeSampleStats();
 };
 
+/*
+ * Loop of the worker processes: sample and count replicates as instructed
+ * by the root process, until it stops.
+ */
 void
-Sim::updateReparameterization(void)
+Sim::runWorker(void)
+{
+#ifdef USE_MPI
+  while (true) {
+    int command;
+    MPI_Bcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (command == COMMAND_LOAD_PARAMS) {
+      loadSampler();
+    } else if (command == COMMAND_SAMPLE) {
+      sampleChains(0, 0, 0);
+    } else if (command == COMMAND_COUNT) {
+      computeSampleStats();
+    } else if (command == COMMAND_SIGNAL) {
+      collectSignal();
+    } else if (command == COMMAND_GATHER) {
+      gatherSamples();
+    } else {
+      return;
+    }
+  }
+#endif
+};
+
+/*
+ * Return the checkpoint signal received by any process since the last call
+ * (SIGTERM over SIGUSR1), or 0, and clear it. With MPI, the root process asks
+ * the workers for theirs, so that all processes stop at the same step.
+ */
+int
+Sim::collectSignal(void)
+{
+  int received = checkpoint_signal;
+  checkpoint_signal = 0;
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    if (mpi_rank == 0) {
+      sendCommand(COMMAND_SIGNAL);
+    }
+    int local = (received == SIGTERM) ? 2 : ((received == SIGUSR1) ? 1 : 0);
+    int any = 0;
+    MPI_Reduce(&local, &any, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (mpi_rank == 0) {
+      received = (any == 2) ? SIGTERM : ((any == 1) ? SIGUSR1 : 0);
+    }
+  }
+#endif
+  return received;
+};
+
+void
+Sim::stopWorkers(void)
+{
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    sendCommand(COMMAND_STOP);
+  }
+#endif
+};
+
+/*
+ * Compute the gradient and the errors, adapt the learning rates and update
+ * the parameters in one pass. The current model is only read, and the new
+ * gradient, learning rates and parameters are written to the previous model,
+ * so that the two can be swapped afterwards. In lean mode, there is no
+ * previous model and the current model is updated in place. The coupling
+ * blocks are handled in parallel, and their contributions to the errors are
+ * summed in a fixed order, so the result does not depend on the number of
+ * threads. Returns true if the error is below error_max.
+ */
+bool
+Sim::updateModel(void)
 {
   double M_eff = msa_stats.getEffectiveM();
   int N = msa_stats.getN();
-  int M = msa_stats.getM();
+  const arma::Col<int>& Q_site = msa_stats.alphabet_sizes;
+  double max_step_J = max_step_J_N / N;
+
+  double lambda_h = lambda_reg1;
+  double lambda_j = lambda_reg2;
+
+  Model* next_model = lean_memory ? current_model : previous_model;
+  const potts_model& params = current_model->params;
+  const potts_model& gradient = current_model->gradient;
+  const potts_model& learning_rates = current_model->learning_rates;
+  potts_model& new_params = next_model->params;
+  potts_model& new_gradient = next_model->gradient;
+  potts_model& new_learning_rates = next_model->learning_rates;
+
+  const arma::Mat<double>& msa_1p = msa_stats.frequency_1p;
+  const arma::Mat<double>& mc_1p = mcmc_stats->frequency_1p;
+  const arma::Mat<double>& mc_1p_sigma = mcmc_stats->frequency_1p_sigma;
+
   int Q = msa_stats.getQ();
+  if (optimizer != nullptr) {
+    optimizer->beginUpdate();
+  }
 
+  // Fields: gradient, errors and learning rates. The steps are applied once
+  // the gauge term is known (see below).
+  arma::Mat<double> field_steps = arma::Mat<double>(Q, N, arma::fill::zeros);
+  long int n_1p = 0;
+  double error_1p = 0;
   for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      for (int a = 0; a < Q; a++) {
-        for (int b = 0; b < Q; b++) {
-          current_model->params.J.at(i, j).at(a, b) +=
-            current_model->learning_rates.J.at(i, j).at(a, b) *
-            current_model->gradient.J.at(i, j).at(a, b);
+    int Q_i = Q_site.at(i);
+    n_1p += Q_i;
+    for (int aa = 0; aa < Q_i; aa++) {
+      double delta =
+        mc_1p.at(aa, i) - msa_1p.at(aa, i) + lambda_h * params.h.at(aa, i);
+      double delta_stat =
+        (mc_1p.at(aa, i) - msa_1p.at(aa, i)) /
+        (pow(msa_1p.at(aa, i) * (1. - msa_1p.at(aa, i)) / M_eff +
+               pow(mc_1p_sigma.at(aa, i), 2) + EPSILON,
+             0.5));
+      error_1p += pow(delta, 2);
+
+      double grad_prev = gradient.h.at(aa, i);
+      double grad = grad_prev;
+      if (fabs(delta_stat) > error_min_update) {
+        grad = -delta;
+      }
+      double rate;
+      if (optimizer == nullptr) {
+        double alfa = Theta(grad * grad_prev) * adapt_up +
+                      Theta(-grad * grad_prev) * adapt_down +
+                      Delta(grad * grad_prev);
+        rate =
+          Min(max_step_h, Max(min_step_h, alfa * learning_rates.h.at(aa, i)));
+        field_steps.at(aa, i) = rate * grad;
+      } else {
+        rate = learning_rates.h.at(aa, i);
+        field_steps.at(aa, i) = optimizer->step(aa + i * Q, grad, rate);
+      }
+      new_gradient.h.at(aa, i) = grad;
+      new_learning_rates.h.at(aa, i) = rate;
+    }
+  }
+
+  // Couplings: one pass over each (i, j) block computes the gradient, the
+  // learning rates and the new couplings, and accumulates the block's share
+  // of the error. Rows of 'pair_sums': 0: error_2p, 1: number of updated
+  // couplings.
+  int n_pairs = N * (N - 1) / 2;
+  std::vector<int> pair_i(n_pairs);
+  std::vector<int> pair_j(n_pairs);
+  long int n_2p = 0;
+  {
+    int pair = 0;
+    for (int i = 0; i < N; i++) {
+      for (int j = i + 1; j < N; j++) {
+        pair_i[pair] = i;
+        pair_j[pair] = j;
+        n_2p += Q_site.at(i) * Q_site.at(j);
+        pair++;
+      }
+    }
+  }
+  if (pair_sums.n_cols != (arma::uword)n_pairs) {
+    pair_sums = arma::Mat<double>(2, n_pairs, arma::fill::zeros);
+  }
+
+  // With an active set, all blocks are only visited ('screened') every
+  // active_set_interval updates, and in between only the blocks that had
+  // significant statistics at the last screening are updated. The others are
+  // frozen, and their share of the errors is that of the last screening.
+  bool screen =
+    (active_set_interval <= 0) || (active_set_age % active_set_interval == 0);
+  std::vector<int> visit;
+  if (screen) {
+    visit.resize(n_pairs);
+    for (int pair = 0; pair < n_pairs; pair++) {
+      visit[pair] = pair;
+    }
+  } else {
+    visit = active_pairs;
+  }
+  int n_visit = visit.size();
+
+  // In lean mode, the coupling gradients are not kept, so each block's share
+  // of the gauge term Dh (see below) is summed during the pass. The same is
+  // done with an active set, so that frozen blocks are not read, and with an
+  // optimizer, whose steps are not kept. Rows 0 to Q_i - 1 hold the terms for
+  // position i, and rows Q to Q + Q_j - 1 those for position j.
+  bool sum_Dh =
+    lean_memory || (active_set_interval > 0) || (optimizer != nullptr);
+  arma::Mat<double> partial_Dh;
+  if (sum_Dh) {
+    partial_Dh = arma::Mat<double>(2 * Q, n_pairs, arma::fill::zeros);
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int v = 0; v < n_visit; v++) {
+    int pair = visit[v];
+    int i = pair_i[pair];
+    int j = pair_j[pair];
+    int Q_i = Q_site.at(i);
+    int Q_j = Q_site.at(j);
+
+    const double* msa_2p = msa_stats.frequency_2p.at(pair).memptr();
+    const double* mc_2p = mcmc_stats->frequency_2p.at(pair).memptr();
+    const double* J = params.J.at(pair).memptr();
+    double* new_J = new_params.J.at(pair).memptr();
+    long int J_index = params.h.n_elem + (J - params.J.memptr());
+    double* sums = pair_sums.colptr(pair);
+    std::fill(sums, sums + 2, 0.0);
+
+    const double* grad_J = nullptr;
+    const double* rate_J = nullptr;
+    double* new_grad_J = nullptr;
+    double* new_rate_J = nullptr;
+    signed char* sign_J = nullptr;
+    float* lean_rate_J = nullptr;
+    double* Dh_i = nullptr;
+    double* Dh_j = nullptr;
+    if (sum_Dh) {
+      Dh_i = partial_Dh.colptr(pair);
+      Dh_j = partial_Dh.colptr(pair) + Q;
+    }
+    if (lean_memory) {
+      long int offset = J - params.J.memptr();
+      sign_J = current_model->lean_gradient_sign_J.data() + offset;
+      lean_rate_J = current_model->lean_learning_rates_J.data() + offset;
+    } else {
+      grad_J = gradient.J.at(pair).memptr();
+      rate_J = learning_rates.J.at(pair).memptr();
+      new_grad_J = new_gradient.J.at(pair).memptr();
+      new_rate_J = new_learning_rates.J.at(pair).memptr();
+    }
+
+    for (int aa2 = 0; aa2 < Q_j; aa2++) {
+      for (int aa1 = 0; aa1 < Q_i; aa1++) {
+        int k = aa2 * Q_i + aa1;
+        double reg = lambda_j * J[k];
+        if (use_pos_reg) {
+          reg = reg * 1. / (1. + fabs(msa_stats.rel_entropy_grad_1p(aa1, i))) /
+                (1. + fabs(msa_stats.rel_entropy_grad_1p(aa2, j)));
+        }
+        double delta = -(msa_2p[k] - mc_2p[k] +
+                         (mc_1p.at(aa1, i) - msa_1p.at(aa1, i)) *
+                           msa_1p.at(aa2, j) +
+                         (mc_1p.at(aa2, j) - msa_1p.at(aa2, j)) *
+                           msa_1p.at(aa1, i) -
+                         reg);
+        double delta_stat =
+          (mc_2p[k] - msa_2p[k]) /
+          (pow(msa_2p[k] * (1.0 - msa_2p[k]) / M_eff + pow(mc_2p[k], 2) +
+                 EPSILON,
+               0.5));
+
+        sums[0] += pow(delta, 2);
+
+        // Only the sign of the previous gradient matters for the learning
+        // rate. In lean mode, as its value is not kept, couplings whose
+        // statistics are within error_min_update are not updated.
+        double grad_prev;
+        double rate_prev;
+        if (lean_memory) {
+          grad_prev = sign_J[k];
+          rate_prev = lean_rate_J[k];
+        } else {
+          grad_prev = grad_J[k];
+          rate_prev = rate_J[k];
+        }
+        double grad = lean_memory ? 0 : grad_prev;
+        if (fabs(delta_stat) > error_min_update) {
+          grad = -delta;
+          sums[1] += 1;
+        }
+        double rate;
+        double step;
+        if (optimizer == nullptr) {
+          double alfa = Theta(grad * grad_prev) * adapt_up +
+                        Theta(-grad * grad_prev) * adapt_down +
+                        Delta(grad * grad_prev);
+          rate = Min(max_step_J, Max(min_step_J, alfa * rate_prev));
+          step = rate * grad;
+        } else {
+          rate = rate_prev;
+          step = optimizer->step(J_index + k, grad, rate);
+        }
+        new_J[k] = J[k] + step;
+
+        if (sum_Dh) {
+          Dh_i[aa1] += -msa_1p.at(aa2, j) * step;
+          Dh_j[aa2] += -msa_1p.at(aa1, i) * step;
+        }
+        if (lean_memory) {
+          sign_J[k] = (grad > 0) - (grad < 0);
+          lean_rate_J[k] = (float)rate;
+        } else {
+          new_grad_J[k] = grad;
+          new_rate_J[k] = rate;
         }
       }
     }
-  };
+  }
+
+  if (active_set_interval > 0) {
+    if (screen) {
+      active_pairs.clear();
+      for (int pair = 0; pair < n_pairs; pair++) {
+        if (pair_sums.at(1, pair) > 0) {
+          active_pairs.push_back(pair);
+        }
+      }
+      std::cout << "(" << active_pairs.size() << " of " << n_pairs
+                << " pairs active) " << std::flush;
+    } else if (!lean_memory && (active_set_age % active_set_interval == 1)) {
+      // The next model was last written before the screening, so copy the
+      // frozen blocks once. Afterwards, both models hold the same values.
+      std::vector<bool> active(n_pairs, false);
+      for (int pair : active_pairs) {
+        active[pair] = true;
+      }
+#pragma omp parallel for schedule(dynamic)
+      for (int pair = 0; pair < n_pairs; pair++) {
+        if (!active[pair]) {
+          new_params.J.at(pair) = params.J.at(pair);
+          new_gradient.J.at(pair) = gradient.J.at(pair);
+          new_learning_rates.J.at(pair) = learning_rates.J.at(pair);
+        }
+      }
+    }
+    active_set_age = screen ? 1 : active_set_age + 1;
+  }
+
+  double error_2p = 0;
+  for (int pair = 0; pair < n_pairs; pair++) {
+    error_2p += pair_sums.at(0, pair);
+  }
 
-  arma::Mat<double> Dh = arma::Mat<double>(Q, N, arma::fill::zeros);
+  // The fields are updated once all couplings are known, as the gauge term
+  // Dh depends on the coupling updates of every pair that involves i.
+#pragma omp parallel for schedule(dynamic)
   for (int i = 0; i < N; i++) {
-    for (int a = 0; a < Q; a++) {
+    for (int a = 0; a < Q_site.at(i); a++) {
+      double Dh = 0;
       for (int j = 0; j < N; j++) {
+        if (sum_Dh) {
+          if (i < j) {
+            Dh += partial_Dh.at(a, params.J.pairIndex(i, j));
+          }
+          if (i > j) {
+            Dh += partial_Dh.at(Q + a, params.J.pairIndex(j, i));
+          }
+          continue;
+        }
         if (i < j) {
-          for (int b = 0; b < Q; b++) {
-            Dh.at(a, i) += -msa_stats.frequency_1p.at(b, j) *
-                           current_model->learning_rates.J.at(i, j).at(a, b) *
-                           current_model->gradient.J.at(i, j).at(a, b);
+          for (int b = 0; b < Q_site.at(j); b++) {
+            Dh += -msa_1p.at(b, j) * new_learning_rates.J.at(i, j).at(a, b) *
+                  new_gradient.J.at(i, j).at(a, b);
           }
         }
         if (i > j) {
-          for (int b = 0; b < Q; b++) {
-            Dh.at(a, i) += -msa_stats.frequency_1p.at(b, j) *
-                           current_model->learning_rates.J.at(j, i).at(b, a) *
-                           current_model->gradient.J.at(j, i).at(b, a);
+          for (int b = 0; b < Q_site.at(j); b++) {
+            Dh += -msa_1p.at(b, j) * new_learning_rates.J.at(j, i).at(b, a) *
+                  new_gradient.J.at(j, i).at(b, a);
           }
         }
       }
+      new_params.h.at(a, i) = params.h.at(a, i) + (field_steps.at(a, i) + Dh);
     }
-  };
+  }
 
-  for (int i = 0; i < N; i++) {
-    for (int a = 0; a < Q; a++) {
-      current_model->params.h.at(a, i) +=
-        current_model->learning_rates.h.at(a, i) *
-          current_model->gradient.h.at(a, i) +
-        Dh.at(a, i);
+  error_1p = sqrt(error_1p / n_1p);
+  error_2p = sqrt(error_2p / n_2p);
+  double error_tot = error_1p + error_2p;
+
+  run_buffer.at((step - 1) % save_parameters, 14) = error_1p;
+  run_buffer.at((step - 1) % save_parameters, 15) = error_2p;
+  run_buffer.at((step - 1) % save_parameters, 16) = error_tot;
+
+  updateSampleSize(error_tot);
+
+  bool converged = false;
+  if (error_tot < error_max) {
+    if (screen) {
+      std::cout << "converged" << std::endl;
+      converged = true;
+    } else {
+      // Confirm with the errors of all blocks at the next update.
+      active_set_age = 0;
     }
   }
+  return converged;
 };
 
 void
-Sim::writeData(std::string id)
+Sim::writeData(std::string id, Model* params_model)
 {
+  if (params_model == nullptr) {
+    params_model = current_model;
+  }
+
   if (output_binary) {
-    current_model->writeParams("parameters_h_" + id + ".bin",
+    params_model->writeParams("parameters_h_" + id + ".bin",
                                "parameters_J_" + id + ".bin");
-    current_model->writeGradient("gradients_h_" + id + ".bin",
-                                 "gradients_J_" + id + ".bin");
+    if (!lean_memory) {
+      current_model->writeGradient("gradients_h_" + id + ".bin",
+                                   "gradients_J_" + id + ".bin");
+    }
     current_model->writeLearningRates("learning_rates_h_" + id + ".bin",
                                       "learning_rate_J_" + id + ".bin");
 
@@ -855,8 +2375,10 @@ Sim::writeData(std::string id)
     mcmc_stats->writeFrequency2p("stat_MC_2p_" + id + ".bin",
                                  "stat_MC_2p_sigma_" + id + ".bin");
   } else {
-    current_model->writeParamsCompat("parameters_" + id + ".txt");
-    current_model->writeGradientCompat("gradients_" + id + ".txt");
+    params_model->writeParamsCompat("parameters_" + id + ".txt");
+    if (!lean_memory) {
+      current_model->writeGradientCompat("gradients_" + id + ".txt");
+    }
     current_model->writeLearningRatesCompat("learning_rates_" + id + ".txt");
 
     mcmc_stats->writeFrequency1pCompat("stat_MC_1p_" + id + ".txt",
@@ -864,10 +2386,18 @@ Sim::writeData(std::string id)
     mcmc_stats->writeFrequency2pCompat("stat_MC_2p_" + id + ".txt",
                                        "stat_MC_2p_sigma_" + id + ".txt");
   }
+  if (optimizer != nullptr) {
+    optimizer->save("optimizer_state_" + id + ".bin");
+  }
   mcmc_stats->writeSamples("MC_samples_" + id + ".txt");
   mcmc_stats->writeSampleEnergies("MC_energies_" + id + ".txt");
 
-  if (check_ergo) {
+  if (check_ergo && (ss_chains > 0)) {
+    chain_pool_stats->writeAutocorrelationStats("autocorrelation_" + id +
+                                                ".txt");
+  } else if (check_ergo && ergo_iat) {
+    mcmc_stats->writeAutocorrelationStats("autocorrelation_" + id + ".txt");
+  } else if (check_ergo) {
     // mcmc_stats->writeSampleEnergiesRelaxation("energy_" + id + ".dat");
     // mcmc_stats->writeEnergyStats("my_energies_start_" + id + ".txt",
     //                              "my_energies_end_" + id + ".txt",
@@ -879,6 +2409,226 @@ Sim::writeData(std::string id)
   }
 };
 
+/*
+ * Increase the number of samples per chain for the next steps, as set by
+ * 'sample_schedule', by a factor 'sample_growth' up to M. Early steps, whose
+ * gradients are large, need fewer samples than late ones. With 'error', the
+ * samples increase each time the error falls by a factor 'sample_error_drop'.
+ * With 'snr', they increase while the signal-to-noise ratio of the gradient,
+ * i.e. the root mean square of the differences between MCMC and MSA
+ * frequencies over that of the MCMC standard deviations, is below
+ * 'sample_snr_min'.
+ */
+void
+Sim::updateSampleSize(double error_tot)
+{
+  if ((sample_schedule == "fixed") || (M_step >= M)) {
+    return;
+  }
+  if (error_scheduled < 0) {
+    error_scheduled = error_tot;
+  }
+
+  bool increase = false;
+  if (sample_schedule == "error") {
+    increase = (error_tot < sample_error_drop * error_scheduled);
+  } else if (sample_schedule == "snr") {
+    double signal = 0;
+    double noise = 0;
+    const arma::Mat<double>& msa_1p = msa_stats.frequency_1p;
+    const arma::Mat<double>& mc_1p = mcmc_stats->frequency_1p;
+    const arma::Mat<double>& mc_1p_sigma = mcmc_stats->frequency_1p_sigma;
+    for (int i = 0; i < (int)msa_1p.n_cols; i++) {
+      for (int aa = 0; aa < msa_stats.alphabet_sizes.at(i); aa++) {
+        signal += pow(mc_1p.at(aa, i) - msa_1p.at(aa, i), 2);
+        noise += pow(mc_1p_sigma.at(aa, i), 2);
+      }
+    }
+    // The 2p standard deviations are not computed in lean mode.
+    const PairTensor& mc_2p_sigma = mcmc_stats->frequency_2p_sigma;
+    if (mc_2p_sigma.n_elem == msa_stats.frequency_2p.n_elem) {
+      const double* msa_2p = msa_stats.frequency_2p.memptr();
+      const double* mc_2p = mcmc_stats->frequency_2p.memptr();
+      const double* sigma_2p = mc_2p_sigma.memptr();
+#pragma omp parallel for reduction(+ : signal, noise)
+      for (long int k = 0; k < mc_2p_sigma.n_elem; k++) {
+        signal += pow(mc_2p[k] - msa_2p[k], 2);
+        noise += pow(sigma_2p[k], 2);
+      }
+    }
+    // The standard deviations over replicates are divided by the fourth root
+    // of their number (see MCMCStats::finalizeSampleStats()), so that of the
+    // mean frequencies is another fourth root smaller.
+    noise /= sqrt((double)count_max);
+    increase = (sqrt(signal / (noise + EPSILON)) < sample_snr_min);
+  }
+  if (increase) {
+    M_step = Min(M, (int)ceil(M_step * sample_growth));
+    error_scheduled = error_tot;
+    std::cout << "(increasing samples per chain to " << M_step << ") "
+              << std::flush;
+  }
+};
+
+/*
+ * Write the state of a synchronous run at the end of the current step, so that
+ * it can be continued exactly with 'bmdca -R': the step, sampling times,
+ * sample size, both models, the optimizer and active set, the pending run log
+ * entries, the size of the run log and the chain pool of 'ss_chains'. The
+ * checkpoint is written to a temporary file that then replaces the previous
+ * one, so a run killed while writing it keeps the previous checkpoint.
+ */
+void
+Sim::writeCheckpoint(int t_wait, int delta_t)
+{
+  std::string temp_file = std::string(CHECKPOINT_FILE) + ".tmp";
+  std::ofstream stream(temp_file, std::ios::binary);
+
+  auto write = [&stream](const void* ptr, long int n_bytes) {
+    stream.write(reinterpret_cast<const char*>(ptr), n_bytes);
+  };
+  auto writeInt = [&write](long int value) { write(&value, sizeof(value)); };
+
+  long int log_size = 0;
+  {
+    std::ifstream log("bmdca_run.log", std::ios::binary | std::ios::ate);
+    if (log.is_open()) {
+      log_size = (long int)log.tellg();
+    }
+  }
+
+  stream.write(CHECKPOINT_MAGIC, 8);
+  writeInt(CHECKPOINT_VERSION);
+  writeInt(current_model->N);
+  writeInt(current_model->Q);
+  writeInt(current_model->params.J.n_elem);
+  writeInt(lean_memory);
+  writeInt(optimizer != nullptr);
+  writeInt(save_parameters);
+  writeInt(step);
+  writeInt(t_wait);
+  writeInt(delta_t);
+  writeInt(log_size);
+  writeInt(M_step);
+  write(&error_scheduled, sizeof(error_scheduled));
+
+  current_model->writeState(stream);
+  if (previous_model != nullptr) {
+    previous_model->writeState(stream);
+  }
+  write(run_buffer.memptr(), run_buffer.n_elem * sizeof(double));
+
+  writeInt(active_set_age);
+  writeInt(active_pairs.size());
+  write(active_pairs.data(), active_pairs.size() * sizeof(int));
+  writeInt(pair_sums.n_cols);
+  write(pair_sums.memptr(), pair_sums.n_elem * sizeof(double));
+
+  if (optimizer != nullptr) {
+    optimizer->save(stream);
+  }
+
+  writeInt(chain_pool_started);
+  write(chain_pool.memptr(), chain_pool.n_elem * sizeof(int));
+  stream.close();
+  if (!stream) {
+    std::cerr << "ERROR: could not write checkpoint." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if (std::rename(temp_file.c_str(), CHECKPOINT_FILE) != 0) {
+    std::cerr << "ERROR: could not replace " << CHECKPOINT_FILE << "."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+};
+
+/*
+ * Restore the state written by writeCheckpoint(), and return the last
+ * completed step. The alignment and settings must be those of the run that
+ * wrote the checkpoint.
+ */
+int
+Sim::readCheckpoint(int* t_wait, int* delta_t)
+{
+  std::ifstream stream(CHECKPOINT_FILE, std::ios::binary);
+  if (!stream.is_open()) {
+    std::cerr << "ERROR: no " << CHECKPOINT_FILE << " to resume from."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  auto read = [&stream](void* ptr, long int n_bytes) {
+    stream.read(reinterpret_cast<char*>(ptr), n_bytes);
+  };
+  auto readInt = [&read]() {
+    long int value = 0;
+    read(&value, sizeof(value));
+    return value;
+  };
+  auto mismatch = []() {
+    std::cerr << "ERROR: the checkpoint does not match the alignment and "
+                 "settings of this run."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  };
+
+  char magic[8] = { 0 };
+  read(magic, 8);
+  if ((std::string(magic, 8) != CHECKPOINT_MAGIC) ||
+      (readInt() != CHECKPOINT_VERSION)) {
+    std::cerr << "ERROR: " << CHECKPOINT_FILE << " is not a bmDCA checkpoint."
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if ((readInt() != current_model->N) || (readInt() != current_model->Q) ||
+      (readInt() != current_model->params.J.n_elem) ||
+      (readInt() != lean_memory) || (readInt() != (optimizer != nullptr)) ||
+      (readInt() != save_parameters)) {
+    mismatch();
+  }
+  int last_step = (int)readInt();
+  *t_wait = (int)readInt();
+  *delta_t = (int)readInt();
+  long int log_size = readInt();
+  M_step = (int)readInt();
+  read(&error_scheduled, sizeof(error_scheduled));
+
+  if (!current_model->readState(stream)) {
+    mismatch();
+  }
+  if ((previous_model != nullptr) && !previous_model->readState(stream)) {
+    mismatch();
+  }
+  read(run_buffer.memptr(), run_buffer.n_elem * sizeof(double));
+
+  active_set_age = (int)readInt();
+  active_pairs = std::vector<int>(readInt());
+  read(active_pairs.data(), active_pairs.size() * sizeof(int));
+  long int n_pairs = readInt();
+  if (n_pairs > 0) {
+    pair_sums = arma::Mat<double>(2, n_pairs);
+    read(pair_sums.memptr(), pair_sums.n_elem * sizeof(double));
+  }
+
+  if ((optimizer != nullptr) && !optimizer->load(stream)) {
+    mismatch();
+  }
+
+  chain_pool_started = (readInt() == 1);
+  read(chain_pool.memptr(), chain_pool.n_elem * sizeof(int));
+  if (!stream) {
+    mismatch();
+  }
+
+  // Drop the log entries written after the checkpoint, which the resumed run
+  // writes again.
+  if (truncate("bmdca_run.log", log_size) != 0) {
+    std::cerr << "ERROR: could not truncate bmdca_run.log." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  return last_step;
+};
+
 void
 Sim::initializeRunLog()
 {
@@ -891,7 +2641,14 @@ Sim::initializeRunLog()
          << "\t"
          << "burn-between"
          << "\t";
-  if (check_ergo) {
+  if (check_ergo && ergo_iat) {
+    stream << "iat"
+           << "\t"
+           << "ess"
+           << "\t"
+           << "burn-in-samples"
+           << "\t";
+  } else if (check_ergo) {
     stream << "auto-corr"
            << "\t"
            << "cross-corr"
@@ -921,7 +2678,18 @@ Sim::initializeRunLog()
          << "\t"
          << "seed"
          << "\t"
-         << "step-time" << std::endl;
+         << "step-time";
+  if (sample_schedule != "fixed") {
+    stream << "\t"
+           << "samples";
+  }
+  if (async_sampling) {
+    stream << "\t"
+           << "staleness-avg"
+           << "\t"
+           << "staleness-max";
+  }
+  stream << std::endl;
   stream.close();
 };
 
@@ -941,7 +2709,11 @@ Sim::writeRunLog(int current_step)
     stream << (int)run_buffer.at(i, 1) << "\t";
     stream << (int)run_buffer.at(i, 2) << "\t";
     stream << (int)run_buffer.at(i, 3) << "\t";
-    if (check_ergo) {
+    if (check_ergo && ergo_iat) {
+      stream << run_buffer.at(i, 22) << "\t";
+      stream << run_buffer.at(i, 23) << "\t";
+      stream << run_buffer.at(i, 24) << "\t";
+    } else if (check_ergo) {
       stream << run_buffer.at(i, 4) << "\t";
       stream << run_buffer.at(i, 5) << "\t";
       stream << run_buffer.at(i, 6) << "\t";
@@ -957,7 +2729,15 @@ Sim::writeRunLog(int current_step)
     stream << run_buffer.at(i, 15) << "\t";
     stream << run_buffer.at(i, 16) << "\t";
     stream << (long int)run_buffer.at(i, 17) << "\t";
-    stream << run_buffer.at(i, 18) << std::endl;
+    stream << run_buffer.at(i, 18);
+    if (sample_schedule != "fixed") {
+      stream << "\t" << (int)run_buffer.at(i, 21);
+    }
+    if (async_sampling) {
+      stream << "\t" << run_buffer.at(i, 19);
+      stream << "\t" << (int)run_buffer.at(i, 20);
+    }
+    stream << std::endl;
   }
   run_buffer.zeros();
   stream.close();
@@ -1,11 +1,19 @@
 #ifndef BMDCA_RUN_HPP
 #define BMDCA_RUN_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "mcmc.hpp"
 #include "mcmc_stats.hpp"
 #include "model.hpp"
 #include "msa.hpp"
 #include "msa_stats.hpp"
+#include "optimizer.hpp"
+#include "pcg_random.hpp"
 #include "utils.hpp"
 
 class Sim
@@ -13,19 +21,37 @@ class Sim
 public:
   Sim(MSAStats, std::string);
   ~Sim(void);
-  void run(void);
+  void initializeModel(const MSA*);
+  void initializeChains(const MSA*);
+  void run(bool = false);
+  void runQuick(void);
   void loadParameters(std::string);
   void writeParameters(std::string);
+  static bool needsAlignment(std::string, bool);
 
 private:
   // Member functions
   void initializeParameters(void);
   void checkParameters(void);
-  void readInitialSample(int, int);
-  bool computeErrorReparametrization(void);
-  void updateLearningRate(void);
-  void updateReparameterization(void);
-  void writeData(std::string);
+  arma::Col<int> readInitialSample(int, int);
+  bool updateModel(void);
+  void printMemoryPlan(void);
+  void loadSampler(void);
+  void sampleChains(int, int, long int, bool = false);
+  void sampleChainPool(int, int, long int);
+  bool gatherSamples(void);
+  void computeSampleStats(void);
+  void runWorker(void);
+  void stopWorkers(void);
+  int collectSignal(void);
+  void runAsync(void);
+  void runSampler(int, int);
+  bool publishSnapshot(long int);
+  void stopSamplers(void);
+  void writeData(std::string, Model* = nullptr);
+  void updateSampleSize(double);
+  void writeCheckpoint(int, int);
+  int readCheckpoint(int*, int*);
 
   // BM settings
   double lambda_reg1;  // L2 regularization strength for 1p statistics (fields)
@@ -49,6 +75,31 @@ private:
   double error_min_update; // minimal number of standard deviation s of z
                            // variable for having parameter update (if
                            // negative or zero all parameters are updated)
+  int active_set_interval; // number of updates between screenings of all
+                           // couplings (if zero or negative, screen at each
+                           // update)
+
+  // Initialization settings
+  std::string init_method; // 'profile' (independent sites), 'plm', 'mf' or
+                           // 'parameters'
+  double plm_lambda_h;     // L2 regularization of the fields for 'plm'
+  double plm_lambda_J;     // L2 regularization of the couplings for 'plm'
+  int plm_iterations;      // maximum L-BFGS iterations for each position
+  double mf_pseudocount;   // weight of uniform frequencies for 'mf'
+  std::string init_parameters_file;       // text parameters for 'parameters'
+  std::string init_parameters_h_file;     // binary fields for 'parameters'
+  std::string init_parameters_J_file;     // binary couplings for 'parameters'
+  std::string init_learning_rates_file;   // text learning rates (optional)
+  std::string init_learning_rates_h_file; // binary learning rates for fields
+  std::string init_learning_rates_J_file; // binary learning rates for cplings
+  std::string init_position_map;          // positions of the initial model
+
+  // Optimizer settings
+  std::string optimizer_name; // 'adaptive', 'adam' or 'nesterov'
+  double adam_beta1;          // decay of Adam's first moment
+  double adam_beta2;          // decay of Adam's second moment
+  double adam_epsilon;        // regularizer of Adam's steps
+  double nesterov_momentum;   // momentum of Nesterov's velocity
 
   // Sampling times
   int t_wait_0;           // staring thermalization time for MCMC
@@ -59,6 +110,10 @@ private:
                           // thermalization times
   double adapt_down_time; // positive adaptive step for sampling/
                           // thermalization times
+  bool ergo_iat;          // flag to set sampling/thermalization times from
+                          // autocorrelation times (with check_ergo)
+  bool extend_chains;     // flag to continue chains, instead of restarting
+                          // them, when check_ergo resamples
 
   // Importance sampling settings
   int step_importance_max; // importance sampling maximum iterations
@@ -66,14 +121,65 @@ private:
 
   // MCMC settings
   bool use_ss = false;          // flag to use stochastic sampling mode
+  int ss_chains;                // number of persistent chains that emit the
+                                // samples of use_ss (0: one chain per sample)
   int step;                     // current step number
   int M;                        // number of samples for each MCMC run
   int count_max;                // number of independent MCMC runs
   bool init_sample = false;     // flag for loading the first positions when
                                 // initializing the mcmc from a file
   std::string init_sample_file; // name of file with mcmc initial sample
+  std::string chain_init;       // start of the chains: 'random', 'msa'
+                                // (weighted draws from the alignment) or
+                                // 'file' (draws from chain_init_file)
+  std::string chain_init_file;  // FASTA file of initial sequences for 'file'
   bool use_pos_reg = false;     // enable for position-specific regularizetion
   double temperature;           // temperature at which to sample potts model
+  std::string site_order;       // positions of the MCMC steps: 'random', or
+                                // sweeps in order ('sweep') or in a random
+                                // order ('shuffled'), with times in sweeps
+  int block_pairs;              // number of most strongly coupled pairs that
+                                // are also updated jointly (0: none)
+  double block_rate;            // fraction of MCMC steps that are joint
+                                // updates of one of these pairs
+
+  // Sample size schedule settings
+  std::string sample_schedule; // 'fixed', 'error' or 'snr'
+  int M_min;                   // samples per chain at the first step
+  double sample_growth;        // multiple by which to increase samples
+  double sample_error_drop;    // error ratio between increases for 'error'
+  double sample_snr_min;       // signal-to-noise ratio below which to
+                               // increase samples for 'snr'
+  int M_step;                  // samples per chain at the current step
+  double error_scheduled;      // error at the last increase of samples
+
+  // Alphabet compression settings
+  bool compress_alphabet = false; // flag to keep only frequent states at
+                                  // each position (plus one lumped state)
+  double alphabet_min_frequency;  // minimum MSA frequency of a kept state
+
+  // Memory settings
+  bool lean_memory = false; // flag to keep a single model, with gradient signs
+                            // and single-precision learning rates
+
+  // Asynchronous sampling settings
+  bool async_sampling = false; // flag to sample and learn concurrently
+  int async_threads;           // number of sampler threads (0: all cores but
+                               // one)
+  double async_fresh_fraction; // fraction of the chains that must be
+                               // resampled before each update
+
+  // Checkpoint settings
+  int checkpoint_interval; // number of steps between checkpoints (if zero or
+                           // negative, only on SIGTERM or SIGUSR1)
+
+  // Distributed sampling (MPI)
+  int mpi_rank = 0; // rank of this process (0 holds the model)
+  int mpi_size = 1; // number of processes
+  int rep_first;    // first MCMC replicate sampled by this process
+  int rep_last;     // one past the last replicate sampled by this process
+  bool samples_gathered = true; // whether the root process holds the samples
+                                // of all processes
 
   // // Check routine settings
   // int t_wait_check;  // t_wait
@@ -93,7 +199,14 @@ private:
 
   // Sample data
   arma::Cube<int> samples;
-  arma::Col<int> initial_sample;
+  std::vector<long int> sample_times; // MC steps of each sample of the chains
+
+  // Persistent chains of 'ss_chains', with the samples of their last step
+  arma::Cube<int> chain_pool;
+  bool chain_pool_started = false;
+  MCMCStats* chain_pool_stats = nullptr;
+  arma::Mat<int> initial_samples; // initial sequence of each replicate of
+                                  // this process (one per column), if set
 
   // Stats from original MSA
   MSAStats msa_stats;
@@ -105,8 +218,32 @@ private:
   // MCMC
   MCMC* mcmc;
 
+  // Parameter update rule (nullptr for adaptive learning rates)
+  Optimizer* optimizer;
+
   // Stats from MCMC samples
   MCMCStats* mcmc_stats;
+
+  // Active set state
+  std::vector<int> active_pairs; // pairs with significant couplings at the
+                                 // last screening
+  int active_set_age = 0;        // updates since the last screening
+  arma::Mat<double> pair_sums;   // error terms of each pair at its last update
+
+  // Asynchronous sampling state: parameter snapshots read by the sampler
+  // threads, and the pool of their latest chains.
+  MCMC* snapshots[2];
+  long int snapshot_version[2];         // update that each snapshot holds
+  std::atomic<int> snapshot_readers[2]; // samplers using each snapshot
+  std::atomic<int> snapshot_published;  // snapshot for new chains
+  std::atomic<bool> stop_samplers;
+  std::vector<std::thread> samplers;
+  std::mutex pool_mutex;
+  std::condition_variable pool_ready;
+  arma::Cube<int> sample_pool;
+  std::vector<long int> pool_version; // snapshot of each chain (-1: empty)
+  int pool_filled;                    // number of non-empty slots
+  int pool_fresh;                     // chains added since the last update
 };
 
 #endif
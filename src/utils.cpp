@@ -1,8 +1,11 @@
 
 #include "utils.hpp"
 
+#include <cmath>
+#include <cstdint>
 #include <string>
 #include <iostream>
+#include <sys/resource.h>
 
 #ifndef AA_ALPHABET_SIZE
 #define AA_ALPHABET_SIZE 21
@@ -74,12 +77,7 @@ loadPottsModelCompat(std::string parameters_file)
 
   potts_model params;
   params.h = arma::Mat<double>(Q, N, arma::fill::zeros);
-  params.J = arma::field<arma::Mat<double>>(N, N);
-  for (int i = 0; i < N; i++) {
-    for (int j = i + 1; j < N; j++) {
-      params.J.at(i, j) = arma::Mat<double>(Q, Q, arma::fill::zeros);
-    }
-  }
+  params.J = PairTensor(N, Q);
 
   // Read parameters
   int n1, n2, aa1, aa2;
@@ -101,36 +99,183 @@ loadPottsModelCompat(std::string parameters_file)
   return params;
 };
 
-int
-Theta(double x)
+/*
+ * Return the number of states at each position of a model. Fields may be
+ * padded to the full alphabet, so the sizes are read from the couplings.
+ */
+arma::Col<int>
+getAlphabetSizes(const potts_model& model)
 {
-  if (x > 0)
-    return 1;
-  return 0;
+  int N = model.h.n_cols;
+  arma::Col<int> alphabet_sizes = arma::Col<int>(N);
+  alphabet_sizes.fill(model.h.n_rows);
+  for (int i = 0; i + 1 < N; i++) {
+    alphabet_sizes.at(i) = model.J.at(i, i + 1).n_rows;
+    alphabet_sizes.at(i + 1) = model.J.at(i, i + 1).n_cols;
+  }
+  return alphabet_sizes;
 };
 
-int
-Delta(double x)
+/*
+ * An alphabet map (Q x N) gives the compressed state of each amino acid at
+ * each position. Return, for each amino acid and position, the number of
+ * amino acids that share its compressed state.
+ */
+arma::Mat<double>
+getLumpSizes(const arma::Mat<int>& alphabet_map)
 {
-  if (x == 0)
-    return 1;
-  return 0;
+  int Q = alphabet_map.n_rows;
+  int N = alphabet_map.n_cols;
+  arma::Mat<double> lump_sizes = arma::Mat<double>(Q, N, arma::fill::zeros);
+  for (int i = 0; i < N; i++) {
+    for (int aa1 = 0; aa1 < Q; aa1++) {
+      for (int aa2 = 0; aa2 < Q; aa2++) {
+        if (alphabet_map.at(aa1, i) == alphabet_map.at(aa2, i)) {
+          lump_sizes.at(aa1, i) += 1;
+        }
+      }
+    }
+  }
+  return lump_sizes;
 };
 
-double
-Max(double a, double b)
+/*
+ * Expand 1p values over compressed states back to the full alphabet. If
+ * 'split' is set, the value of a lumped state is shared evenly between its
+ * amino acids (e.g. for frequencies), and copied to each of them otherwise.
+ */
+arma::Mat<double>
+expandAlphabet1p(const arma::Mat<double>& values,
+                 const arma::Mat<int>& alphabet_map,
+                 bool split)
 {
-  if (a > b)
-    return a;
-  return b;
+  int Q = alphabet_map.n_rows;
+  int N = alphabet_map.n_cols;
+  arma::Mat<double> lump_sizes = getLumpSizes(alphabet_map);
+  arma::Mat<double> expanded = arma::Mat<double>(Q, N);
+  for (int i = 0; i < N; i++) {
+    for (int aa = 0; aa < Q; aa++) {
+      expanded.at(aa, i) = values.at(alphabet_map.at(aa, i), i);
+      if (split) {
+        expanded.at(aa, i) /= lump_sizes.at(aa, i);
+      }
+    }
+  }
+  return expanded;
 };
 
-double
-Min(double a, double b)
+/*
+ * Expand blocks of 2p values over compressed states back to the full
+ * alphabet, as in expandAlphabet1p().
+ */
+PairTensor
+expandAlphabet2p(const PairTensor& values,
+                 const arma::Mat<int>& alphabet_map,
+                 bool split)
 {
-  if (a < b)
-    return a;
-  return b;
+  int Q = alphabet_map.n_rows;
+  int N = alphabet_map.n_cols;
+  arma::Mat<double> lump_sizes = getLumpSizes(alphabet_map);
+  PairTensor expanded = PairTensor(N, Q);
+  for (int i = 0; i < N; i++) {
+    for (int j = i + 1; j < N; j++) {
+      const arma::Mat<double>& block = values.at(i, j);
+      arma::Mat<double>& expanded_block = expanded.at(i, j);
+      for (int aa1 = 0; aa1 < Q; aa1++) {
+        for (int aa2 = 0; aa2 < Q; aa2++) {
+          expanded_block.at(aa1, aa2) =
+            block.at(alphabet_map.at(aa1, i), alphabet_map.at(aa2, j));
+          if (split) {
+            expanded_block.at(aa1, aa2) /=
+              lump_sizes.at(aa1, i) * lump_sizes.at(aa2, j);
+          }
+        }
+      }
+    }
+  }
+  return expanded;
+};
+
+/*
+ * Expand a model over compressed states to the full alphabet. The amino acids
+ * of a lumped state share its couplings, and their fields are lowered by the
+ * log of the lump size, so that the expanded model gives the lumped state the
+ * same total probability.
+ */
+potts_model
+expandPottsModel(const potts_model& model, const arma::Mat<int>& alphabet_map)
+{
+  potts_model expanded;
+  expanded.J = expandAlphabet2p(model.J, alphabet_map);
+  expanded.h = expandAlphabet1p(model.h, alphabet_map);
+
+  arma::Mat<double> lump_sizes = getLumpSizes(alphabet_map);
+  for (int i = 0; i < (int)expanded.h.n_cols; i++) {
+    for (int aa = 0; aa < (int)expanded.h.n_rows; aa++) {
+      expanded.h.at(aa, i) -= log(lump_sizes.at(aa, i));
+    }
+  }
+  return expanded;
+};
+
+/*
+ * Map a residue to its index in "-ACDEFGHIKLMNPQRSTVWY". Non-standard residues
+ * are treated as gaps, and characters that are not residues at all return -1.
+ */
+int
+aaToNumeric(char aa)
+{
+  switch (aa) {
+    case '-':
+    case 'B':
+    case 'J':
+    case 'O':
+    case 'U':
+    case 'X':
+    case 'Z':
+      return 0;
+    case 'A':
+      return 1;
+    case 'C':
+      return 2;
+    case 'D':
+      return 3;
+    case 'E':
+      return 4;
+    case 'F':
+      return 5;
+    case 'G':
+      return 6;
+    case 'H':
+      return 7;
+    case 'I':
+      return 8;
+    case 'K':
+      return 9;
+    case 'L':
+      return 10;
+    case 'M':
+      return 11;
+    case 'N':
+      return 12;
+    case 'P':
+      return 13;
+    case 'Q':
+      return 14;
+    case 'R':
+      return 15;
+    case 'S':
+      return 16;
+    case 'T':
+      return 17;
+    case 'V':
+      return 18;
+    case 'W':
+      return 19;
+    case 'Y':
+      return 20;
+  }
+  return -1;
 };
 
 int
@@ -146,3 +291,35 @@ deleteFile(std::string filename) {
   fs.close();
   return 0;
 };
+
+/*
+ * Return the peak resident set size of the process in MB.
+ */
+double
+getPeakMemoryUsage(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.;
+};
+
+/*
+ * Return the seed of MCMC sampling attempt 'attempt' of step 'step' of a run
+ * with seed 'seed', mixed with SplitMix64 so that it only depends on these
+ * three numbers. The chains of a sampling then use their replicate number as
+ * PCG stream. The seed fits in 31 bits, so it is logged exactly.
+ */
+long int
+deriveSeed(long int seed, long int step, long int attempt)
+{
+  auto mix = [](uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  };
+  uint64_t x = mix((uint64_t)seed);
+  x = mix(x ^ (uint64_t)step);
+  x = mix(x ^ (uint64_t)attempt);
+  return (long int)(x >> 33);
+};
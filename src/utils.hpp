@@ -4,6 +4,8 @@
 #include <armadillo>
 #include <string>
 
+#include "pair_tensor.hpp"
+
 class SeqRecord
 {
 private:
@@ -20,7 +22,7 @@ public:
 
 typedef struct
 {
-  arma::field<arma::Mat<double>> J;
+  PairTensor J;
   arma::Mat<double> h;
 } potts_model;
 
@@ -28,19 +30,64 @@ potts_model loadPottsModel(std::string, std::string);
 
 potts_model loadPottsModelCompat(std::string);
 
-int
-Theta(double);
+arma::Col<int> getAlphabetSizes(const potts_model&);
+
+arma::Mat<double> getLumpSizes(const arma::Mat<int>&);
+
+arma::Mat<double> expandAlphabet1p(const arma::Mat<double>&,
+                                   const arma::Mat<int>&,
+                                   bool = false);
+
+PairTensor expandAlphabet2p(const PairTensor&,
+                            const arma::Mat<int>&,
+                            bool = false);
+
+potts_model expandPottsModel(const potts_model&, const arma::Mat<int>&);
 
 int
-Delta(double);
+aaToNumeric(char);
 
-double
-Max(double, double);
+// Small helpers used in the inner loops of the parameter updates, so they are
+// defined inline.
+inline int
+Theta(double x)
+{
+  if (x > 0)
+    return 1;
+  return 0;
+};
 
-double
-Min(double, double);
+inline int
+Delta(double x)
+{
+  if (x == 0)
+    return 1;
+  return 0;
+};
+
+inline double
+Max(double a, double b)
+{
+  if (a > b)
+    return a;
+  return b;
+};
+
+inline double
+Min(double a, double b)
+{
+  if (a < b)
+    return a;
+  return b;
+};
 
 int
 deleteFile(std::string);
 
+double
+getPeakMemoryUsage(void);
+
+long int
+deriveSeed(long int, long int, long int);
+
 #endif